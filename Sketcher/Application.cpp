@@ -10,6 +10,10 @@
 #include "Worker.h"
 #include "Log.h"
 #include "FileDialog.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "MeshCache.h"
+#include "ObjReader.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
@@ -21,6 +25,7 @@ Application::Application() :
 	show_console(true),
 	show_test_window(false),
 	show_camera(false),
+	show_profiler(false),
 	save_screenshot(false) {
 
 	// uncomment to specify mesh to load at startup
@@ -30,6 +35,8 @@ Application::Application() :
 }
 
 void Application::DrawInterface(GLFWwindow* window) {
+	// keeps the log queue from filling up while the console is hidden
+	Log::Instance().Flush();
 	if (!show_interface) return;
 
 	if (ImGui::BeginMainMenuBar()) {
@@ -54,6 +61,8 @@ void Application::DrawInterface(GLFWwindow* window) {
 		ImGui::SameLine();
 		ImGui::Checkbox("Camera", &show_camera);
 		ImGui::SameLine();
+		ImGui::Checkbox("Profiler", &show_profiler);
+		ImGui::SameLine();
 		//if (ImGui::BeginMenu("Window")) {
 		//	ImGui::MenuItem("Controls", "", &show_controls);
 		//	ImGui::MenuItem("Visualization", "", &show_visualization);
@@ -62,8 +71,9 @@ void Application::DrawInterface(GLFWwindow* window) {
 		//	ImGui::MenuItem("Test Window", "", &show_test_window);
 		//	ImGui::EndMenu();
 		//}
-		ImGui::SameLine(ImGui::GetWindowWidth() - 80);
-		ImGui::Text("(%.0f fps)", ImGui::GetIO().Framerate);
+		ImGui::SameLine(ImGui::GetWindowWidth() - 170);
+		ImGui::Text("(%.0f fps, %.0f%% busy)", loop_fps, loop_busy * 100);
+		if (ImGui::IsItemHovered()) ImGui::SetTooltip("Frames drawn and main thread time not spent waiting, last second");
 		ImGui::EndMainMenuBar();
 	}
 
@@ -80,6 +90,7 @@ void Application::DrawInterface(GLFWwindow* window) {
 		ImGui::SetNextWindowSize(ImVec2(300, 680), ImGuiSetCond_FirstUseEver);
 		ImGui::Begin("Controls", &show_controls);
 		ImGui::PushItemWidth(180);
+		DrawTaskStatus();
 		if (ImGui::Button("Open Mesh (O)", button_size)) {
 			LoadMeshDialog();
 		}
@@ -88,17 +99,28 @@ void Application::DrawInterface(GLFWwindow* window) {
 		if (ImGui::TreeNode("Options##openmesh")) {
 			ImGui::Checkbox("Move mesh to origin on load", &move_mesh_to_origin);
 			ImGui::Checkbox("Normalize mesh on load", &normalize_mesh);
+			ImGui::Checkbox("Use mesh cache", &use_mesh_cache);
+			if (ImGui::IsItemHovered()) ImGui::SetTooltip("Reload unchanged files from a binary snapshot");
+			ImGui::Checkbox("Fast OBJ reader", &use_fast_obj_reader);
+			if (ImGui::IsItemHovered()) ImGui::SetTooltip("Read OBJ files on all cores instead of with OpenMesh");
+			if (ImGui::SmallButton("Compare with OpenMesh")) {
+				Worker::Do([]() {
+					std::string filename = file_dialog({ { "obj", "Wavefront OBJ" } }, false);
+					if (!filename.empty()) ObjReader::CompareWithOpenMesh(filename);
+				}, Priority::Normal, "Compare OBJ readers");
+			}
+			if (ImGui::IsItemHovered()) ImGui::SetTooltip("Read a file with both readers and check they give the same mesh");
 			if (ImGui::SmallButton("Move mesh to origin now")) {
 				Worker::Do([]() { 
 					mesh().move_to_origin();
 					Renderer::Instance().InvalidateGeometry();
-				});
+				}, Priority::High, "Move mesh to origin");
 			}
 			if (ImGui::SmallButton("Normalize mesh now")) {
 				Worker::Do([]() { 
 					mesh().normalize();
 					Renderer::Instance().InvalidateGeometry();
-				});
+				}, Priority::High, "Normalize mesh");
 			}
 			ImGui::TreePop();
 		}
@@ -110,7 +132,7 @@ void Application::DrawInterface(GLFWwindow* window) {
 					OpenMesh::IO::write_mesh(cmesh(), name + ".obj");
 					print("Saving complete\n");
 				}
-			});
+			}, Priority::High, "Save mesh");
 		}
 		if (ImGui::Button("Reset All (R)", button_size)) {
 			ResetAll();
@@ -125,17 +147,47 @@ void Application::DrawInterface(GLFWwindow* window) {
 				for (const VertexHandle v : cmesh().vertices()) {
 					mesh().set_point(v, cbackup().point(v));
 				}
-				Renderer::Instance().InvalidateGeometry();
+				Renderer::Instance().InvalidatePositions();
 				print("Unsmoothing done\n");
-			});
+			}, Priority::High, "Reset geometry");
 		}
 		if (ImGui::IsItemHovered()) ImGui::SetTooltip("Reset vertex positions");
 
-		if (ImGui::SliderFloat("Feature max angle", &(mesh().feature_max_angle), 0, 181, "%.0f deg")) {
-			Renderer::Instance().GetShader(FeaturesEdges)->Invalidate();
+		float feature_max_angle = cmesh().feature_max_angle;
+		if (ImGui::SliderFloat("Feature max angle", &feature_max_angle, 0, 181, "%.0f deg")) {
+			Renderer::Instance().SetFeatureMaxAngle(feature_max_angle);
 		}
 		if (ImGui::IsItemHovered()) ImGui::SetTooltip("Feature edge dihedral angle threshold");
 
+		ImGui::Separator();
+		ImGui::Checkbox("Redraw on demand", &redraw_on_demand);
+		if (ImGui::IsItemHovered()) ImGui::SetTooltip("Only draw when something changes, otherwise every frame");
+		ImGui::SliderInt("Max fps", &max_fps, 0, 240);
+		if (ImGui::IsItemHovered()) ImGui::SetTooltip("Frame rate limit, 0 for none");
+		if (ImGui::SmallButton("Benchmark tasks")) Worker::Benchmark();
+		if (ImGui::IsItemHovered()) ImGui::SetTooltip("Time how fast queued and submitted tasks start");
+
+#if SKETCHER_TRACING
+		bool tracing = Trace::enabled;
+		if (ImGui::Checkbox("Trace", &tracing)) Trace::enabled = tracing;
+		if (ImGui::IsItemHovered()) ImGui::SetTooltip("Record the timeline of tasks, loading and drawing");
+		ImGui::SameLine();
+		if (ImGui::SmallButton("Export trace")) {
+			Worker::Do([]() {
+				std::string name = file_dialog({ { "json", "Chrome trace" } }, true);
+				if (name.empty()) return;
+				if (name.size() < 5 || name.substr(name.size() - 5) != ".json") name += ".json";
+				if (Trace::ExportJSON(name)) {
+					print("Saved trace to %s, open it in chrome://tracing or ui.perfetto.dev\n", name.c_str());
+				} else {
+					print(LogLevel::Error, "Could not write %s\n", name.c_str());
+				}
+			}, Priority::High, "Export trace");
+		}
+		ImGui::SameLine();
+		if (ImGui::SmallButton("Clear trace")) Trace::Clear();
+#endif
+
 		ImGui::End();
 	}
 
@@ -146,16 +198,42 @@ void Application::DrawInterface(GLFWwindow* window) {
 	if (show_camera) {
 		Renderer::Instance().DrawCameraInterface(&show_camera);
 	}
+
+	if (show_profiler) {
+		Profiler::Instance().Draw("Profiler", &show_profiler);
+	}
 }
 
 void Application::ResetAll() {
 	Worker::Do([&]() {
 		mesh().render_ready = false;
+		Renderer::Instance().StopMeshTasks();
 		RestoreBackup();
 		mesh().initialize();
 		mesh().render_ready = true;
 		Renderer::Instance().InvalidateGeometry();
-	});
+	}, Priority::High, "Reset all");
+}
+
+void Application::DrawTaskStatus() {
+	const TaskHandle running = Worker::Running();
+	if (running) {
+		ImGui::Text("Running: %s", running->Name().empty() ? "task" : running->Name().c_str());
+		ImGui::ProgressBar(running->Progress(), ImVec2(180, 0));
+		ImGui::SameLine();
+		if (running->CancelRequested()) {
+			ImGui::TextDisabled("Cancelling...");
+		} else if (ImGui::SmallButton("Cancel")) {
+			running->Cancel();
+		}
+	}
+	const size_t queued = Worker::QueueSize();
+	if (queued > 0) {
+		ImGui::Text("%d queued", (int)queued);
+	}
+	if (running || queued > 0) {
+		ImGui::Separator();
+	}
 }
 
 void Application::PostRender() {
@@ -197,28 +275,71 @@ void Application::LoadMeshDialog() {
 		if (!filename.empty()) {
 			LoadMesh(filename);
 		}
-	});
+	}, Priority::Normal, "Load mesh");
 }
 
 void Application::LoadMesh(const std::string filename) {
-	mesh().render_ready = false;
+	TRACE_FUNCTION();
 	print("Loading %s\n", filename.c_str());
 
-	OpenMesh::IO::Options opt = OpenMesh::IO::Options::VertexNormal;
-	if (!OpenMesh::IO::read_mesh(mesh(), filename, opt)) {
-		print("Error reading mesh!\n");
+	// load in a separate mesh so the current one stays untouched if cancelled.
+	// It then becomes the backup as is, so loading only copies it once
+	std::shared_ptr<MyMesh> loaded = std::make_shared<MyMesh>();
+	loaded->feature_max_angle = cmesh().feature_max_angle;
+
+	MeshCache::Key key;
+	const uint32_t options = (move_mesh_to_origin ? MeshCache::MoveToOrigin : 0)
+		| (normalize_mesh ? MeshCache::Normalize : 0);
+	const bool cache = use_mesh_cache && MeshCache::MakeKey(filename, options, key);
+	const bool from_cache = cache && MeshCache::Load(key, *loaded);
+	if (!from_cache) {
+		OpenMesh::IO::Options opt = OpenMesh::IO::Options::VertexNormal;
+		bool read;
+		{
+			TRACE_SCOPE("Read mesh");
+			if (use_fast_obj_reader && ObjReader::IsObj(filename)) {
+				read = ObjReader::Read(filename, *loaded);
+			} else {
+				read = OpenMesh::IO::read_mesh(*loaded, filename, opt);
+			}
+		}
+		if (!read && !Worker::Cancelled()) {
+			print("Error reading mesh!\n");
+			return;
+		}
+		Worker::SetProgress(0.7f);
+		if (Worker::Cancelled()) {
+			print("Loading cancelled\n");
+			return;
+		}
+
+		// geometry first, normals and edge length are computed on the final positions
+		TaskFuture<void> origin = Worker::Submit([&]() { 
+			if (move_mesh_to_origin) loaded->move_to_origin(); }, {}, "Move to origin");
+		TaskFuture<void> normalized = Worker::Submit([&]() { 
+			if (normalize_mesh) loaded->normalize(); }, { origin }, "Normalize");
+		normalized.Wait();
+		loaded->initialize();
+	}
+	Worker::SetProgress(0.9f);
+	if (Worker::Cancelled()) {
+		print("Loading cancelled\n");
 		return;
 	}
-	mesh().initialize();
-	if (move_mesh_to_origin) mesh().move_to_origin();
-	if (normalize_mesh) mesh().normalize();
+
+	mesh().render_ready = false;
+	Renderer::Instance().StopMeshTasks();
+	// the old backup is freed before the copy, so there are at most three meshes
+	SetBackup(loaded);
+	mesh() = *loaded;
 
 	Renderer::Instance().ResetCamera();
 	Renderer::Instance().InvalidateGeometry();
 
 	mesh().render_ready = true;
 
-	DoBackup();
-
 	print("Loaded %s\n", filename.c_str());
+
+	// written after loading from the backup, which does not change, so the mesh can be used meanwhile
+	if (cache && !from_cache) MeshCache::SaveAsync(key, loaded);
 }
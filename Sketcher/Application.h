@@ -30,7 +30,18 @@ public:
 
 	bool save_screenshot;
 
+	// the main loop waits for input or changes instead of drawing continuously,
+	// and draws at most max_fps frames per second, 0 for no limit
+	bool redraw_on_demand = true;
+	int max_fps = 60;
+	// measured by the main loop over the last second: frames drawn, and 
+	// fraction of the time it was not waiting
+	float loop_fps = 0.0f;
+	float loop_busy = 0.0f;
+
 private:
+	// running task, progress and cancel button
+	void DrawTaskStatus();
 
 	bool show_interface;
 	bool show_controls;
@@ -38,7 +49,12 @@ private:
 	bool show_console;
 	bool show_test_window;
 	bool show_camera;
+	bool show_profiler;
 
 	bool move_mesh_to_origin = true;
 	bool normalize_mesh = true;
+	// reload from a binary snapshot when the file did not change, see MeshCache
+	bool use_mesh_cache = true;
+	// parallel reader for obj files, see ObjReader
+	bool use_fast_obj_reader = true;
 };
@@ -0,0 +1,241 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+#include "Worker.h"
+
+namespace {
+	const double infinity = std::numeric_limits<double>::infinity();
+
+	// triangles per leaf
+	const size_t max_leaf_size = 4;
+	// subtrees smaller than this are built by a single thread
+	const size_t min_parallel_size = 1 << 14;
+	// deeper than any tree with median splits
+	const size_t max_depth = 64;
+
+	// Möller–Trumbore, returns the hit distance or infinity
+	double RayTriangle(const Vec3d& origin, const Vec3d& direction,
+		const Vec3d& p0, const Vec3d& p1, const Vec3d& p2) {
+		const Vec3d e1 = p1 - p0;
+		const Vec3d e2 = p2 - p0;
+		const Vec3d p = OpenMesh::cross(direction, e2);
+		const double det = OpenMesh::dot(e1, p);
+		if (det == 0.0) return infinity; // parallel to the triangle
+		const double inv_det = 1.0 / det;
+
+		const Vec3d s = origin - p0;
+		const double u = OpenMesh::dot(s, p) * inv_det;
+		if (u < 0.0 || u > 1.0) return infinity;
+		const Vec3d q = OpenMesh::cross(s, e1);
+		const double v = OpenMesh::dot(direction, q) * inv_det;
+		if (v < 0.0 || u + v > 1.0) return infinity;
+		const double t = OpenMesh::dot(e2, q) * inv_det;
+		return t >= 0.0 ? t : infinity;
+	}
+}
+
+void FaceBVH::Box::Reset() {
+	min = Vec3d(infinity, infinity, infinity);
+	max = Vec3d(-infinity, -infinity, -infinity);
+}
+
+void FaceBVH::Box::Extend(const Vec3d& p) {
+	min.minimize(p);
+	max.maximize(p);
+}
+
+void FaceBVH::Box::Extend(const Box& box) {
+	min.minimize(box.min);
+	max.maximize(box.max);
+}
+
+double FaceBVH::Box::Intersect(const Vec3d& origin, const Vec3d& inv_direction, double max_t) const {
+	double t_min = 0.0;
+	double t_max = max_t;
+	for (int axis = 0; axis < 3; ++axis) {
+		double t0 = (min[axis] - origin[axis]) * inv_direction[axis];
+		double t1 = (max[axis] - origin[axis]) * inv_direction[axis];
+		if (t0 > t1) std::swap(t0, t1);
+		t_min = std::max(t_min, t0);
+		t_max = std::min(t_max, t1);
+		if (t_min > t_max) return infinity;
+	}
+	return t_min;
+}
+
+FaceBVH::Box FaceBVH::TriangleBox(const MyMesh& mesh, const Triangle& triangle) {
+	Box box;
+	box.Reset();
+	for (int i = 0; i < 3; ++i) {
+		box.Extend(mesh.point(VertexHandle(triangle.v[i])));
+	}
+	return box;
+}
+
+void FaceBVH::Build(const MyMesh& mesh) {
+	n_faces_ = mesh.n_faces();
+	n_vertices_ = mesh.n_vertices();
+
+	// same triangle fans as the renderer
+	std::vector<size_t> first_triangle;
+	Worker::ParallelPrefixSum(n_faces_, first_triangle, [&mesh](size_t f) {
+		return size_t(mesh.valence(FaceHandle((int)f)) - 2);
+	});
+	std::vector<BuildItem> items(first_triangle.back());
+	Worker::ParallelFor(0, n_faces_, [&](size_t f) {
+		const FaceHandle fh((int)f);
+		MyMesh::ConstFaceVertexCCWIter it = mesh.cfv_ccwbegin(fh);
+		const VertexHandle first = *it;
+		++it;
+		for (size_t i = first_triangle[f]; i < first_triangle[f + 1]; ++i) {
+			BuildItem& item = items[i];
+			item.triangle.face = (int)f;
+			item.triangle.v[0] = first.idx();
+			item.triangle.v[1] = it->idx();
+			++it;
+			item.triangle.v[2] = it->idx();
+			item.box = TriangleBox(mesh, item.triangle);
+			item.centroid = (item.box.min + item.box.max) / 2.0;
+		}
+	});
+
+	nodes_.clear();
+	triangles_.clear();
+	if (items.empty() || Worker::Cancelled()) return;
+
+	// split the top levels between threads, a couple more than needed to balance
+	int parallel_depth = 1;
+	while ((size_t(1) << parallel_depth) < Worker::Concurrency()) ++parallel_depth;
+	BuildNode(0, items.size(), items, nodes_, parallel_depth + 1);
+	if (Worker::Cancelled()) {
+		nodes_.clear();
+		return;
+	}
+
+	triangles_.resize(items.size());
+	Worker::ParallelFor(0, items.size(), [&](size_t i) {
+		triangles_[i] = items[i].triangle;
+	});
+}
+
+void FaceBVH::BuildNode(size_t begin, size_t end, std::vector<BuildItem>& items,
+	std::vector<Node>& nodes, int parallel_depth) {
+	if (Worker::Cancelled()) return; // the tree is thrown away
+	const size_t index = nodes.size();
+	nodes.push_back(Node());
+
+	Box box;
+	Box centroids;
+	box.Reset();
+	centroids.Reset();
+	for (size_t i = begin; i < end; ++i) {
+		box.Extend(items[i].box);
+		centroids.Extend(items[i].centroid);
+	}
+	nodes[index].box = box;
+
+	// split at the median centroid along the longest axis
+	const Vec3d extent = centroids.max - centroids.min;
+	int axis = 0;
+	if (extent[1] > extent[axis]) axis = 1;
+	if (extent[2] > extent[axis]) axis = 2;
+	if (end - begin <= max_leaf_size || extent[axis] <= 0.0) {
+		// also when all the centroids are the same point, there is no way to split them
+		nodes[index].offset = (uint32_t)begin;
+		nodes[index].count = (uint32_t)(end - begin);
+		return;
+	}
+	const size_t middle = (begin + end) / 2;
+	std::nth_element(items.begin() + begin, items.begin() + middle, items.begin() + end,
+		[axis](const BuildItem& a, const BuildItem& b) { return a.centroid[axis] < b.centroid[axis]; });
+	nodes[index].count = 0;
+
+	if (parallel_depth > 0 && end - begin >= min_parallel_size) {
+		// the halves are a nested parallel loop, so this also works inside a task
+		std::vector<Node> right;
+		Worker::ParallelPieces(2, [&](size_t half) {
+			if (half == 0) {
+				BuildNode(begin, middle, items, nodes, parallel_depth - 1);
+			} else {
+				BuildNode(middle, end, items, right, parallel_depth - 1);
+			}
+		});
+		nodes[index].offset = (uint32_t)(nodes.size() - index);
+		nodes.insert(nodes.end(), right.begin(), right.end());
+	} else {
+		BuildNode(begin, middle, items, nodes, 0);
+		nodes[index].offset = (uint32_t)(nodes.size() - index);
+		BuildNode(middle, end, items, nodes, 0);
+	}
+}
+
+void FaceBVH::Refit(const MyMesh& mesh) {
+	if (mesh.n_faces() != n_faces_ || mesh.n_vertices() != n_vertices_) {
+		Build(mesh);
+		return;
+	}
+	Worker::ParallelFor(0, nodes_.size(), [&](size_t i) {
+		Node& node = nodes_[i];
+		if (node.count == 0) return;
+		node.box.Reset();
+		for (size_t t = node.offset; t < node.offset + node.count; ++t) {
+			node.box.Extend(TriangleBox(mesh, triangles_[t]));
+		}
+	});
+	// children come after their parent
+	for (size_t i = nodes_.size(); i-- > 0;) {
+		Node& node = nodes_[i];
+		if (node.count > 0) continue;
+		node.box = nodes_[i + 1].box;
+		node.box.Extend(nodes_[i + node.offset].box);
+	}
+}
+
+FaceBVH::Hit FaceBVH::Intersect(const MyMesh& mesh, const Vec3d& origin, const Vec3d& direction) const {
+	Hit hit;
+	if (nodes_.empty()) return hit;
+
+	const Vec3d inv_direction(1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2]);
+	double best_t = infinity;
+	uint32_t stack[max_depth];
+	size_t stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		const uint32_t index = stack[--stack_size];
+		const Node& node = nodes_[index];
+		if (node.box.Intersect(origin, inv_direction, best_t) == infinity) continue;
+
+		if (node.count > 0) {
+			for (size_t i = node.offset; i < node.offset + node.count; ++i) {
+				const Triangle& triangle = triangles_[i];
+				const double t = RayTriangle(origin, direction,
+					mesh.point(VertexHandle(triangle.v[0])),
+					mesh.point(VertexHandle(triangle.v[1])),
+					mesh.point(VertexHandle(triangle.v[2])));
+				if (t < best_t) {
+					best_t = t;
+					hit.face = FaceHandle(triangle.face);
+				}
+			}
+			continue;
+		}
+
+		// visit the closer child first, so farther boxes get skipped more often
+		uint32_t near_child = index + 1;
+		uint32_t far_child = index + node.offset;
+		const double near_t = nodes_[near_child].box.Intersect(origin, inv_direction, best_t);
+		const double far_t = nodes_[far_child].box.Intersect(origin, inv_direction, best_t);
+		if (far_t < near_t) std::swap(near_child, far_child);
+		if (std::max(near_t, far_t) < infinity) stack[stack_size++] = far_child;
+		if (std::min(near_t, far_t) < infinity) stack[stack_size++] = near_child;
+	}
+
+	if (hit.face.is_valid()) {
+		hit.t = best_t;
+		hit.point = origin + direction * best_t;
+	}
+	return hit;
+}
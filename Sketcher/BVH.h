@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include "CommonDefs.h"
+#include "MyMesh.h"
+
+// Bounding volume hierarchy over the faces of a mesh, used for picking.
+// Faces are split in the same triangle fans the renderer draws.
+// It stores vertex indices only, so it must be used with the mesh it was built from.
+class FaceBVH {
+public:
+	struct Hit {
+		FaceHandle face; // invalid if nothing was hit
+		double t = 0.0; // hit point is origin + t * direction
+		Vec3d point;
+	};
+
+	// Builds the hierarchy for the current positions, in parallel. Stops early,
+	// leaving it empty, if the running task is cancelled
+	void Build(const MyMesh& mesh);
+	// Recomputes the boxes after vertices moved, keeping the tree.
+	// Faster than Build but the tree gets worse the more the vertices move.
+	void Refit(const MyMesh& mesh);
+
+	// Closest face hit by the ray, for t >= 0. Both sides of the faces are hit
+	Hit Intersect(const MyMesh& mesh, const Vec3d& origin, const Vec3d& direction) const;
+
+	bool Empty() const { return nodes_.empty(); }
+	size_t NumFaces() const { return n_faces_; }
+	size_t NumVertices() const { return n_vertices_; }
+
+private:
+	struct Box {
+		Vec3d min;
+		Vec3d max;
+
+		void Reset();
+		void Extend(const Vec3d& p);
+		void Extend(const Box& box);
+		// entry distance of the ray, infinity if it misses or enters after max_t
+		double Intersect(const Vec3d& origin, const Vec3d& inv_direction, double max_t) const;
+	};
+
+	struct Triangle {
+		int face;
+		int v[3];
+	};
+
+	// Nodes are in depth first order: the left child of a node comes right after it
+	struct Node {
+		Box box;
+		// leaf: first triangle, inner node: distance to the right child
+		uint32_t offset;
+		// triangles in the leaf, 0 for inner nodes
+		uint32_t count;
+	};
+
+	struct BuildItem {
+		Triangle triangle;
+		Box box;
+		Vec3d centroid;
+	};
+
+	// builds the subtree of items[begin, end) into nodes. Offsets are relative,
+	// so subtrees can be built separately and then appended
+	static void BuildNode(size_t begin, size_t end, std::vector<BuildItem>& items,
+		std::vector<Node>& nodes, int parallel_depth);
+	static Box TriangleBox(const MyMesh& mesh, const Triangle& triangle);
+
+	std::vector<Triangle> triangles_;
+	std::vector<Node> nodes_;
+	size_t n_faces_ = 0;
+	size_t n_vertices_ = 0;
+};
@@ -5,6 +5,8 @@
 #include <assert.h>
 #include <cmath>
 #include <stdlib.h>
+#include <vector>
+#include <algorithm>
 
 //-----------------------------------------------------------------------------
 /// Template class for colors with RGB-components.
@@ -129,3 +131,39 @@ public:
     }
 
 };
+
+//-----------------------------------------------------------------------------
+/// Maps values in [0, 1] to colors through a table, interpolating between
+/// evenly spaced color stops.
+class Colormap {
+public:
+	enum { size = 256 };
+
+	Colormap(const std::vector<Color>& stops) : table_(4, size) {
+		assert(!stops.empty());
+		for (int i = 0; i < size; ++i) {
+			const float t = float(i) / (size - 1) * (stops.size() - 1);
+			const size_t stop = std::min(size_t(t), stops.size() - 1);
+			const size_t next = std::min(stop + 1, stops.size() - 1);
+			const float w = t - stop;
+			// as plain vectors, Color arithmetic leaves the alpha alone
+			const Eigen::Vector4f& a = stops[stop];
+			const Eigen::Vector4f& b = stops[next];
+			table_.col(i) = a * (1.0f - w) + b * w;
+		}
+	}
+
+	/// blue, cyan, green, yellow, red
+	static Colormap Rainbow() {
+		return Colormap({ Color::Blue(), Color::Cyan(), Color::Green(), Color::Yellow(), Color::Red() });
+	}
+
+	/// Color of t, clamped to [0, 1]
+	Eigen::Matrix4Xf::ConstColXpr Map(const float t) const {
+		const float clamped = t > 0.0f ? (t < 1.0f ? t : 1.0f) : 0.0f; // also maps NaN to 0
+		return table_.col(int(clamped * (size - 1) + 0.5f));
+	}
+
+private:
+	Eigen::Matrix4Xf table_;
+};
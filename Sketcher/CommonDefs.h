@@ -31,6 +31,16 @@ enum Render {
 	N_RENDER_MODES
 };
 
+// name of a render mode, for the interface and reports
+inline const char* RenderName(enum Render mode) {
+	static const char* const names[N_RENDER_MODES] = {
+		"Shaded", "Solid", "Debug Face", "Debug Edge", "Wireframe", "Single Edge",
+		"Features Edges", "Boundary Edges", "Picker Vertex", "Picker Edge", "Picker Face",
+		"Vertex Normals", "Edge Normals", "Face Normals",
+	};
+	return mode >= 0 && mode < N_RENDER_MODES ? names[mode] : "";
+}
+
 using OpenMesh::Vec3d;
 using OpenMesh::Vec4d;
 
@@ -3,6 +3,8 @@
 #include <iostream>
 #include <iterator>
 #include <fstream>
+#include <vector>
+#include <algorithm>
 
 #include "Log.h"
 
@@ -54,22 +56,22 @@ GLuint GLShader::createShader_helper(GLint type,
 	return id;
 }
 
+std::string GLShader::ReadFile(const std::string &filename) {
+	if (filename.empty())
+		return "";
+	std::ifstream t(filename);
+	return std::string((std::istreambuf_iterator<char>(t)),
+		std::istreambuf_iterator<char>());
+}
+
 bool GLShader::InitFromFiles(
 	const std::string &vertex_fname,
 	const std::string &fragment_fname,
 	const std::string &geometry_fname) {
-	auto file_to_string = [](const std::string &filename) -> std::string {
-		if (filename.empty())
-			return "";
-		std::ifstream t(filename);
-		return std::string((std::istreambuf_iterator<char>(t)),
-			std::istreambuf_iterator<char>());
-	};
-
 	return Init(
-		file_to_string(vertex_fname),
-		file_to_string(fragment_fname),
-		file_to_string(geometry_fname));
+		ReadFile(vertex_fname),
+		ReadFile(fragment_fname),
+		ReadFile(geometry_fname));
 }
 
 bool GLShader::Init(
@@ -82,6 +84,7 @@ bool GLShader::Init(
 	std::string defines;
 	for (auto def : mDefinitions)
 		defines += std::string("#define ") + def.first + std::string(" ") + def.second + "\n";
+	defines += mPrelude;
 
 	glGenVertexArrays(1, &mVertexArrayObject);
 	mVertexShader =
@@ -129,6 +132,7 @@ bool GLShader::Init(
 	if (mGeometryShader)
 		glDetachShader(mProgramShader, mGeometryShader);
 
+	CacheUniforms();
 	initialized = true;
 	return true;
 }
@@ -144,8 +148,41 @@ GLint GLShader::attrib(const std::string &name, bool warn) const {
 }
 
 GLint GLShader::uniform(const std::string &name, bool warn) const {
-	GLint id = glGetUniformLocation(mProgramShader, name.c_str());
-	return id;
+	auto it = mUniforms.find(name);
+	if (it == mUniforms.end())
+		return -1;
+	return it->second;
+}
+
+void GLShader::CacheUniforms() {
+	mUniforms.clear();
+	GLint count = 0;
+	GLint max_length = 0;
+	glGetProgramiv(mProgramShader, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(mProgramShader, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+	std::vector<char> buffer(std::max(max_length, 1));
+	for (GLint i = 0; i < count; ++i) {
+		GLint size;
+		GLenum type;
+		glGetActiveUniform(mProgramShader, (GLuint)i, (GLsizei)buffer.size(), nullptr,
+			&size, &type, buffer.data());
+		std::string name(buffer.data());
+		// uniforms in blocks have no location
+		const GLint location = glGetUniformLocation(mProgramShader, name.c_str());
+		if (location < 0)
+			continue;
+		mUniforms[name] = location;
+		// arrays are listed as "name[0]", and can be set by their name too
+		const size_t bracket = name.find('[');
+		if (bracket != std::string::npos)
+			mUniforms[name.substr(0, bracket)] = location;
+	}
+}
+
+void GLShader::BindUniformBlock(const std::string &name, GLuint binding) {
+	const GLuint index = glGetUniformBlockIndex(mProgramShader, name.c_str());
+	if (index != GL_INVALID_INDEX)
+		glUniformBlockBinding(mProgramShader, index, binding);
 }
 
 void GLShader::UploadAttrib(const std::string &name, uint32_t size, int dim,
@@ -157,13 +194,17 @@ void GLShader::UploadAttrib(const std::string &name, uint32_t size, int dim,
 	}
 
 	GLuint bufferID;
+	bool same_size = false; // overwrite the buffer instead of reallocating it
 	auto it = mBufferObjects.find(name);
 	if (it != mBufferObjects.end()) {
 		Buffer &buffer = it->second;
 		bufferID = it->second.id;
+		same_size = buffer.size == size && buffer.compSize == compSize && size > 0;
 		buffer.version = version;
 		buffer.size = size;
 		buffer.compSize = compSize;
+		buffer.glType = glType;
+		buffer.dim = dim;
 	} else {
 		glGenBuffers(1, &bufferID);
 		Buffer buffer;
@@ -179,10 +220,18 @@ void GLShader::UploadAttrib(const std::string &name, uint32_t size, int dim,
 
 	if (name == "indices") {
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bufferID);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, totalSize, data, GL_DYNAMIC_DRAW);
+		if (same_size) {
+			glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, totalSize, data);
+		} else {
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, totalSize, data, GL_DYNAMIC_DRAW);
+		}
 	} else {
 		glBindBuffer(GL_ARRAY_BUFFER, bufferID);
-		glBufferData(GL_ARRAY_BUFFER, totalSize, data, GL_DYNAMIC_DRAW);
+		if (same_size) {
+			glBufferSubData(GL_ARRAY_BUFFER, 0, totalSize, data);
+		} else {
+			glBufferData(GL_ARRAY_BUFFER, totalSize, data, GL_DYNAMIC_DRAW);
+		}
 		if (size == 0) {
 			glDisableVertexAttribArray(attribID);
 		} else {
@@ -192,6 +241,22 @@ void GLShader::UploadAttrib(const std::string &name, uint32_t size, int dim,
 	}
 }
 
+void GLShader::UploadAttribRange(const std::string &name, uint32_t offset, uint32_t size, 
+	int dim, uint32_t compSize, const uint8_t *data) {
+	auto it = mBufferObjects.find(name);
+	if (it == mBufferObjects.end())
+		throw std::runtime_error("uploadAttribRange(" + name + ") : buffer not found!");
+
+	const Buffer &buf = it->second;
+	if (buf.dim != (GLuint)dim || buf.compSize != compSize || offset + size > buf.size)
+		throw std::runtime_error("uploadAttribRange: size mismatch!");
+	if (size == 0) return;
+
+	const GLenum target = name == "indices" ? GL_ELEMENT_ARRAY_BUFFER : GL_ARRAY_BUFFER;
+	glBindBuffer(target, buf.id);
+	glBufferSubData(target, (size_t)offset * compSize, (size_t)size * compSize, data);
+}
+
 void GLShader::DownloadAttrib(const std::string &name, uint32_t size, int /* dim */,
 	uint32_t compSize, GLuint /* glType */, uint8_t *data) {
 	auto it = mBufferObjects.find(name);
@@ -226,7 +291,8 @@ void GLShader::ShareAttrib(const GLShader &otherShader, const std::string &name,
 			return;
 		glEnableVertexAttribArray(attribID);
 		glBindBuffer(GL_ARRAY_BUFFER, buffer.id);
-		glVertexAttribPointer(attribID, buffer.dim, buffer.glType, buffer.compSize == 1 ? GL_TRUE : GL_FALSE, 0, 0);
+		const bool integral = buffer.glType != GL_FLOAT && buffer.glType != GL_DOUBLE;
+		glVertexAttribPointer(attribID, buffer.dim, buffer.glType, integral ? GL_TRUE : GL_FALSE, 0, 0);
 	} else {
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer.id);
 	}
@@ -276,4 +342,5 @@ void GLShader::Free() {
 	glDeleteShader(mVertexShader);   mVertexShader = 0;
 	glDeleteShader(mFragmentShader); mFragmentShader = 0;
 	glDeleteShader(mGeometryShader); mGeometryShader = 0;
+	mUniforms.clear();
 }
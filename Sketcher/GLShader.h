@@ -2,6 +2,7 @@
 
 #include <string>
 #include <map>
+#include <unordered_map>
 
 #include <GL\gl3w.h>
 
@@ -25,6 +26,7 @@ class GLShader {
 private:
 	static GLuint createShader_helper(GLint type,
 		const std::string &defines, std::string shader_string);
+	static std::string ReadFile(const std::string &filename);
 
 public:
 	/// Create an unitialized OpenGL shader
@@ -46,6 +48,11 @@ public:
 	/// Set a preprocessor definition
 	void Define(const std::string &key, const std::string &value) { mDefinitions[key] = value; }
 
+	/// Add source shared by all the stages, inserted after the definitions
+	void Prepend(const std::string &source) { mPrelude += source; }
+	/// Same, with the source of a file on disk
+	void PrependFile(const std::string &filename) { Prepend(ReadFile(filename)); }
+
 	/// Select this shader for subsequent draw calls
 	void Bind();
 
@@ -55,13 +62,22 @@ public:
 	/// Return the handle of a named shader attribute (-1 if it does not exist)
 	GLint attrib(const std::string &name, bool warn = true) const;
 
-	/// Return the handle of a uniform attribute (-1 if it does not exist)
+	/// Return the handle of a uniform attribute (-1 if it does not exist).
+	/// Locations are cached when the program is linked
 	GLint uniform(const std::string &name, bool warn = true) const;
 
+	/// Bind a uniform block to a buffer binding point, if the program uses it
+	void BindUniformBlock(const std::string &name, GLuint binding);
+
 	/// Upload an Eigen matrix as a vertex buffer object (refreshing it as needed)
 	template <typename Matrix> void UploadAttrib(const std::string &name, 
 		const Matrix &M, int version = -1);
 
+	/// Overwrite part of an existing vertex buffer object, starting at the given column.
+	/// The matrix must have the same rows and scalar type as the uploaded one
+	template <typename Matrix> void UploadAttribRange(const std::string &name,
+		const Matrix &M, uint32_t first_column);
+
 	/// Download a vertex buffer object into an Eigen matrix
 	template <typename Matrix> void DownloadAttrib(const std::string &name, 
 		Matrix &M);
@@ -169,8 +185,12 @@ protected:
 	void UploadAttrib(const std::string &name, uint32_t size, int dim,
 		uint32_t compSize, GLuint glType, bool integral,
 		const uint8_t *data, int version = -1);
+	void UploadAttribRange(const std::string &name, uint32_t offset, uint32_t size, 
+		int dim, uint32_t compSize, const uint8_t *data);
 	void DownloadAttrib(const std::string &name, uint32_t size, int dim,
 		uint32_t compSize, GLuint glType, uint8_t *data);
+	/// Query the locations of all the active uniforms, after linking
+	void CacheUniforms();
 protected:
 	struct Buffer {
 		GLuint id;
@@ -190,6 +210,8 @@ protected:
 	GLuint mVertexArrayObject;
 	std::map<std::string, Buffer> mBufferObjects;
 	std::map<std::string, std::string> mDefinitions;
+	std::string mPrelude;
+	std::unordered_map<std::string, GLint> mUniforms;
 };
 
 template<typename Matrix>
@@ -203,6 +225,14 @@ void GLShader::UploadAttrib(const std::string & name,
 		glType, integral, (const uint8_t *)M.data(), version);
 }
 
+template<typename Matrix>
+void GLShader::UploadAttribRange(const std::string & name,
+	const Matrix& M, uint32_t first_column) {
+	uint32_t compSize = sizeof(typename Matrix::Scalar);
+	UploadAttribRange(name, first_column * (uint32_t)M.rows(), (uint32_t)M.size(), 
+		(int)M.rows(), compSize, (const uint8_t *)M.data());
+}
+
 template<typename Matrix>
 inline void GLShader::DownloadAttrib(const std::string & name, Matrix & M) {
 	uint32_t compSize = sizeof(typename Matrix::Scalar);
@@ -1,13 +1,82 @@
 #include "Log.h"
 
-bool Log::print_enabled = true;
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <algorithm>
+
+namespace {
+	// texts waiting to be shown, more are dropped
+	const size_t queue_capacity = 4096;
+	// records waiting to be written, larger since the file may be slow
+	const size_t file_queue_capacity = 16384;
+	// remove lines in batches, so trimming does not copy the buffer every time
+	const int trim_slack = 256;
+	// longest time a record waits before being written
+	const std::chrono::milliseconds file_interval(100);
+
+	std::atomic<int> next_thread(0);
+	thread_local int thread_number = -1;
+
+	int ThreadNumber() {
+		if (thread_number < 0) thread_number = next_thread++;
+		return thread_number;
+	}
+
+	const char* LevelName(LogLevel level) {
+		switch (level) {
+		case LogLevel::Debug: return "DEBUG";
+		case LogLevel::Info: return "INFO ";
+		case LogLevel::Warning: return "WARN ";
+		case LogLevel::Error: return "ERROR";
+		}
+		return "";
+	}
+
+	ImVec4 LevelColor(LogLevel level) {
+		switch (level) {
+		case LogLevel::Debug: return ImVec4(0.6f, 0.6f, 0.6f, 1.0f);
+		case LogLevel::Warning: return ImVec4(1.0f, 0.8f, 0.2f, 1.0f);
+		case LogLevel::Error: return ImVec4(1.0f, 0.35f, 0.35f, 1.0f);
+		default: return ImVec4(1.0f, 1.0f, 1.0f, 1.0f);
+		}
+	}
+
+	// appends "date time.ms [level] [Tn] text", with a newline
+	void FormatRecord(LogLevel level, int thread,
+		const std::chrono::system_clock::time_point& time, const char* text, int text_length, std::string& out) {
+		const time_t seconds = std::chrono::system_clock::to_time_t(time);
+		const int ms = (int)(std::chrono::duration_cast<std::chrono::milliseconds>(
+			time.time_since_epoch()).count() % 1000);
+		tm local;
+#if defined(_WIN32)
+		localtime_s(&local, &seconds);
+#else
+		localtime_r(&seconds, &local);
+#endif
+		char prefix[64];
+		const size_t length = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &local);
+		snprintf(prefix + length, sizeof(prefix) - length, ".%03d [%s] [T%d] ", ms, LevelName(level), thread);
+		out += prefix;
+		out.append(text, text_length);
+		if (text_length == 0 || text[text_length - 1] != '\n') out += '\n';
+	}
+}
+
+std::atomic<bool> Log::print_enabled(true);
+std::atomic<LogLevel> Log::min_level(LogLevel::Info);
+int Log::max_lines = 10000;
+std::string Log::file_path = "sketcher.log";
 
-Log* Log::instance_ = nullptr;
 Log& Log::Instance() {
-	if (instance_ == nullptr) instance_ = new Log();
-	return *instance_;
+	static Log instance;
+	return instance;
 }
 
+Log::Log()
+	: queue_(queue_capacity), dropped_(0), ScrollToBottom(false),
+	file_queue_(file_queue_capacity), file_open_(false), file_dropped_(0), file_flush_(false) {}
+
 void print(const char* fmt, ...) {
 	if (!Log::print_enabled) return;
 	va_list args;
@@ -16,8 +85,17 @@ void print(const char* fmt, ...) {
 	va_end(args);
 }
 
+void print(LogLevel level, const char* fmt, ...) {
+	if (!Log::print_enabled) return;
+	va_list args;
+	va_start(args, fmt);
+	Log::Instance().vlog(level, fmt, args);
+	va_end(args);
+}
+
 void Log::Clear() {
-	Buf.clear(); LineOffset.clear();
+	Flush();
+	Buf.clear(); LineOffset.clear(); LineLevel.clear();
 }
 
 void Log::log(const char* fmt, ...) {
@@ -27,28 +105,209 @@ void Log::log(const char* fmt, ...) {
 	va_end(args);
 }
 
-void Log::vlog(const char* fmt, va_list args) {
-	int old_size = Buf.size();
-	Buf.appendv(fmt, args);
-	for (int new_size = Buf.size(); old_size < new_size; ++old_size) {
-		if (Buf[old_size] == '\n') {
-			LineOffset.push_back(old_size);
+void Log::log(LogLevel level, const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vlog(level, fmt, args);
+	va_end(args);
+}
+
+void Log::vlog(LogLevel level, const char* fmt, va_list args) {
+	if (level < min_level.load() || fmt[0] == '\0') return;
+	const int thread = ThreadNumber();
+	const std::chrono::system_clock::time_point time = std::chrono::system_clock::now();
+
+	// formats straight into the claimed slot
+	const auto format = [&](Record& record) {
+		record.level = level;
+		record.thread = thread;
+		record.time = time;
+		va_list record_args;
+		va_copy(record_args, args);
+		const int length = vsnprintf(record.text, Record::text_capacity, fmt, record_args);
+		va_end(record_args);
+		record.length = std::max(0, std::min(length, (int)Record::text_capacity - 1));
+		if (length >= Record::text_capacity) {
+			memcpy(record.text + Record::text_capacity - 5, "...\n", 5);
+		}
+	};
+
+	if (file_open_) {
+		// formatted once, in the file slot, the shown record copies it before it is published
+		const bool queued = file_queue_.Push([&](Record& record) {
+			format(record);
+			const bool shown = queue_.Push([&record](Record& copy) {
+				copy.level = record.level;
+				copy.thread = record.thread;
+				copy.time = record.time;
+				copy.length = record.length;
+				memcpy(copy.text, record.text, record.length + 1);
+			});
+			if (!shown) ++dropped_;
+		});
+		if (!queued) ++file_dropped_;
+		if (file_queue_.ApproxSize() > file_queue_.Capacity() / 2 && !file_flush_.exchange(true)) {
+			file_wakeup_.notify_one();
 		}
+		if (queued) return;
+	}
+	if (!queue_.Push(format)) ++dropped_;
+}
+
+void Log::Flush() {
+	bool appended = false;
+	while (queue_.Pop([this](const Record& record) { Append(record); })) {
+		appended = true;
 	}
+	if (!appended) return;
+	if (LineOffset.Size > max_lines + trim_slack) Trim();
 	ScrollToBottom = true;
 }
 
+void Log::Append(const Record& record) {
+	int offset = Buf.size();
+	// a line starts at the beginning and after every newline
+	bool line_start = offset == 0 || Buf[offset - 1] == '\n';
+	Buf.append("%s", record.text);
+	for (int i = 0; i < record.length; ++i) {
+		if (line_start) {
+			LineOffset.push_back(offset);
+			LineLevel.push_back(record.level);
+		}
+		line_start = record.text[i] == '\n';
+		++offset;
+	}
+}
+
+void Log::Trim() {
+	const int removed = LineOffset.Size - max_lines;
+	if (removed <= 0) return;
+	const int start = LineOffset[removed];
+
+	ImGuiTextBuffer kept;
+	kept.append("%s", Buf.begin() + start);
+	Buf.Buf.swap(kept.Buf);
+
+	ImVector<int> offsets;
+	ImVector<LogLevel> levels;
+	offsets.reserve(max_lines);
+	levels.reserve(max_lines);
+	for (int i = removed; i < LineOffset.Size; ++i) {
+		offsets.push_back(LineOffset[i] - start);
+		levels.push_back(LineLevel[i]);
+	}
+	LineOffset.swap(offsets);
+	LineLevel.swap(levels);
+}
+
+bool Log::OpenFile(const std::string& path) {
+	CloseFile();
+	file_ = fopen(path.c_str(), "a");
+	if (!file_) {
+		print(LogLevel::Error, "Could not open log file %s\n", path.c_str());
+		return false;
+	}
+	file_stop_ = false;
+	file_open_ = true;
+	file_thread_ = std::thread([this]() { RunFileSink(); });
+	return true;
+}
+
+void Log::CloseFile() {
+	if (!file_thread_.joinable()) return;
+	file_open_ = false;
+	{
+		std::lock_guard<std::mutex> lock(file_mutex_);
+		file_stop_ = true;
+	}
+	file_wakeup_.notify_one();
+	file_thread_.join();
+	fclose(file_);
+	file_ = nullptr;
+}
+
+void Log::RunFileSink() {
+	std::string batch;
+	// formats the records in their slots, without copying them out
+	const auto write = [&batch](const Record& record) {
+		FormatRecord(record.level, record.thread, record.time, record.text, record.length, batch);
+	};
+	bool stop = false;
+	while (!stop) {
+		{
+			// producers only notify when the queue is half full, otherwise records
+			// are picked up at the next interval
+			std::unique_lock<std::mutex> lock(file_mutex_);
+			file_wakeup_.wait_for(lock, file_interval, [this]() { return file_stop_ || file_flush_; });
+			stop = file_stop_;
+		}
+		file_flush_ = false;
+		batch.clear();
+		while (file_queue_.Pop(write)) {}
+		const size_t dropped = file_dropped_.exchange(0);
+		if (dropped > 0) {
+			char text[64];
+			const int length = snprintf(text, sizeof(text), "%lu records dropped", (unsigned long)dropped);
+			FormatRecord(LogLevel::Warning, ThreadNumber(), std::chrono::system_clock::now(), text, length, batch);
+		}
+		if (!batch.empty()) {
+			fwrite(batch.data(), 1, batch.size(), file_);
+			fflush(file_);
+		}
+	}
+}
+
 void Log::Draw(const char* title, bool* p_open) {
+	Flush();
 	ImGui::SetNextWindowSize(ImVec2(500, 400), ImGuiSetCond_FirstUseEver);
 	ImGui::Begin(title, p_open);
 	if (ImGui::Button("Clear")) Clear();
 	ImGui::SameLine();
 	bool copy = ImGui::Button("Copy");
+	ImGui::SameLine();
+	ImGui::PushItemWidth(100);
+	ImGui::DragInt("Max lines", &max_lines, 100.0f, 100, 1000000);
+	ImGui::PopItemWidth();
+	ImGui::SameLine();
+	bool debug = min_level.load() == LogLevel::Debug;
+	if (ImGui::Checkbox("Debug", &debug)) {
+		min_level = debug ? LogLevel::Debug : LogLevel::Info;
+	}
+	ImGui::SameLine();
+	bool save = FileOpen();
+	if (ImGui::Checkbox("Save to file", &save)) {
+		if (save) {
+			OpenFile(file_path);
+		} else {
+			CloseFile();
+		}
+	}
+	if (ImGui::IsItemHovered()) ImGui::SetTooltip("Append every record to %s", file_path.c_str());
+	const size_t dropped = dropped_;
+	if (dropped > 0) {
+		ImGui::SameLine();
+		ImGui::TextDisabled("(%lu dropped)", (unsigned long)dropped);
+	}
 	ImGui::Separator();
 	ImGui::BeginChild("scrolling", ImVec2(0, 0), false, ImGuiWindowFlags_HorizontalScrollbar);
-	if (copy) ImGui::LogToClipboard();
-
-	ImGui::TextUnformatted(Buf.begin());
+	if (copy) {
+		// only what is submitted gets copied
+		ImGui::LogToClipboard();
+		ImGui::TextUnformatted(Buf.begin(), Buf.end());
+	} else {
+		// only the visible lines
+		ImGuiListClipper clipper(LineOffset.Size, ImGui::GetTextLineHeightWithSpacing());
+		for (int line = clipper.DisplayStart; line < clipper.DisplayEnd; ++line) {
+			const char* line_begin = Buf.begin() + LineOffset[line];
+			const char* line_end = line + 1 < LineOffset.Size ? Buf.begin() + LineOffset[line + 1] : Buf.end();
+			if (line_end > line_begin && line_end[-1] == '\n') --line_end;
+			const bool colored = LineLevel[line] != LogLevel::Info;
+			if (colored) ImGui::PushStyleColor(ImGuiCol_Text, LevelColor(LineLevel[line]));
+			ImGui::TextUnformatted(line_begin, line_end);
+			if (colored) ImGui::PopStyleColor();
+		}
+		clipper.End();
+	}
 
 	if (ScrollToBottom)
 		ImGui::SetScrollHere(1.0f);
@@ -4,30 +4,195 @@
 
 #include <string>
 #include <sstream>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
+enum class LogLevel {
+	Debug,
+	Info,
+	Warning,
+	Error,
+};
+
 class Log {
 public:
 	static Log& Instance();
 
 	void Clear();
 
+	// Safe to call from any thread. If the queue is full the text is dropped.
+	// Only the text is formatted on the calling thread, straight into the queue,
+	// the record prefix is written by the file sink. Texts longer than
+	// Record::text_capacity are cut, ending in "..."
 	void log(const char* fmt, ...);
-	void vlog(const char* fmt, va_list args);
+	void log(LogLevel level, const char* fmt, ...);
+	void vlog(const char* fmt, va_list args) { vlog(LogLevel::Info, fmt, args); }
+	void vlog(LogLevel level, const char* fmt, va_list args);
+
+	// Moves the queued text to the lines shown. Called by Draw, and every
+	// frame by the application so the queue does not fill up while hidden
+	void Flush();
 
 	void Draw(const char* title, bool* p_open);
 
-	static bool print_enabled;
+	// Appends every record to the file from a background thread, in batches,
+	// as "date time [level] [thread] text". Returns false if it cannot be opened
+	bool OpenFile(const std::string& path);
+	// Writes what is queued and closes the file. Call it before exiting
+	void CloseFile();
+	bool FileOpen() const { return file_open_; }
+
+	// texts dropped because the queue was full
+	size_t Dropped() const { return dropped_; }
+
+	// both are read by every thread logging
+	static std::atomic<bool> print_enabled;
+	// records below this level are ignored before being formatted
+	static std::atomic<LogLevel> min_level;
+	// oldest lines are removed above this
+	static int max_lines;
+	// file used by the "Save to file" option
+	static std::string file_path;
 
 private:
-	static Log* instance_;
+	Log();
+	~Log() { CloseFile(); }
+
+	// stored in the queue slots, so logging does not allocate
+	struct Record {
+		enum { text_capacity = 256 }; // including the terminating null
+
+		LogLevel level;
+		int thread; // small number, in order of the first record of each thread
+		std::chrono::system_clock::time_point time;
+		int length;
+		char text[text_capacity];
+	};
 
-	Log() {};
-	~Log() {};
+	// Bounded lock-free queue for many producers and consumers (D. Vyukov). Each
+	// slot has a sequence number telling whether it is free for the producer
+	// at a position or ready for the consumer at that position
+	template <typename T>
+	class Queue {
+	public:
+		// capacity must be a power of 2
+		explicit Queue(size_t capacity);
+		// fill(T&) writes the item in place in the claimed slot, false if full
+		template <typename Fill>
+		bool Push(const Fill& fill);
+		// consume(const T&) reads the item in place before the slot is freed,
+		// false if empty
+		template <typename Consume>
+		bool Pop(const Consume& consume);
+		// items queued, may be outdated by the time it returns
+		size_t ApproxSize() const {
+			const size_t push = push_pos_.load(std::memory_order_relaxed);
+			const size_t pop = pop_pos_.load(std::memory_order_relaxed);
+			return push > pop ? push - pop : 0;
+		}
+		size_t Capacity() const { return mask_ + 1; }
 
+	private:
+		struct Slot {
+			std::atomic<size_t> sequence;
+			T item;
+		};
+		std::unique_ptr<Slot[]> slots_;
+		const size_t mask_;
+		// on separate cache lines, producers and the consumer touch different ones
+		alignas(64) std::atomic<size_t> push_pos_;
+		alignas(64) std::atomic<size_t> pop_pos_;
+	};
+
+	// appends to Buf, splitting lines
+	void Append(const Record& record);
+	// removes the oldest lines above max_lines
+	void Trim();
+	// writes batches of records until CloseFile
+	void RunFileSink();
+
+	Queue<Record> queue_;
+	std::atomic<size_t> dropped_;
+
+	// only touched by the render thread
 	ImGuiTextBuffer Buf;
-	ImVector<int> LineOffset;
+	ImVector<int> LineOffset; // start of every line in Buf
+	ImVector<LogLevel> LineLevel; // level of the record that started every line
 	bool ScrollToBottom;
+
+	// file sink
+	Queue<Record> file_queue_;
+	std::atomic<bool> file_open_;
+	std::atomic<size_t> file_dropped_;
+	FILE* file_ = nullptr;
+	std::thread file_thread_;
+	std::mutex file_mutex_;
+	std::condition_variable file_wakeup_;
+	bool file_stop_ = false;
+	// set by producers when the queue is filling up, to write before the interval
+	std::atomic<bool> file_flush_;
 };
 
 void print(const char* fmt, ...);
+void print(LogLevel level, const char* fmt, ...);
+
+template <typename T>
+Log::Queue<T>::Queue(size_t capacity)
+	: slots_(new Slot[capacity]), mask_(capacity - 1), push_pos_(0), pop_pos_(0) {
+	for (size_t i = 0; i < capacity; ++i) {
+		slots_[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+template <typename T>
+template <typename Fill>
+bool Log::Queue<T>::Push(const Fill& fill) {
+	size_t pos = push_pos_.load(std::memory_order_relaxed);
+	Slot* slot;
+	while (true) {
+		slot = &slots_[pos & mask_];
+		const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		if (diff == 0) {
+			// free for this position, claim it
+			if (push_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+		} else if (diff < 0) {
+			return false; // the consumer has not freed it yet
+		} else {
+			pos = push_pos_.load(std::memory_order_relaxed);
+		}
+	}
+	fill(slot->item);
+	slot->sequence.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+template <typename T>
+template <typename Consume>
+bool Log::Queue<T>::Pop(const Consume& consume) {
+	size_t pos = pop_pos_.load(std::memory_order_relaxed);
+	Slot* slot;
+	while (true) {
+		slot = &slots_[pos & mask_];
+		const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		const intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (pop_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+		} else if (diff < 0) {
+			return false; // not written yet
+		} else {
+			pos = pop_pos_.load(std::memory_order_relaxed);
+		}
+	}
+	consume(slot->item);
+	// free for the producer one lap later
+	slot->sequence.store(pos + mask_ + 1, std::memory_order_release);
+	return true;
+}
@@ -0,0 +1,84 @@
+#include "MappedFile.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+bool MappedFile::Open(const std::string& path) {
+	Close();
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		CloseHandle(file);
+		return false;
+	}
+	file_ = file;
+	open_ = true;
+	size_ = (size_t)size.QuadPart;
+	if (size_ == 0) return true; // cannot map an empty file
+	mapping_ = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping_) data_ = (const char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) return false;
+	struct stat info;
+	if (fstat(file, &info) != 0) {
+		close(file);
+		return false;
+	}
+	open_ = true;
+	size_ = (size_t)info.st_size;
+	if (size_ > 0) {
+		void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data != MAP_FAILED) {
+			data_ = (const char*)data;
+			madvise(data, size_, MADV_SEQUENTIAL);
+		}
+	}
+	close(file); // the mapping keeps the file
+	if (size_ == 0) return true;
+#endif
+	if (!data_) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::Close() {
+#if defined(_WIN32)
+	if (data_) UnmapViewOfFile(data_);
+	if (mapping_) CloseHandle(mapping_);
+	if (file_) CloseHandle(file_);
+	mapping_ = nullptr;
+	file_ = nullptr;
+#else
+	if (data_) munmap((void*)data_, size_);
+#endif
+	data_ = nullptr;
+	size_ = 0;
+	open_ = false;
+}
+
+bool MappedFile::Stat(const std::string& path, uint64_t& size, int64_t& mtime) {
+#if defined(_WIN32)
+	struct _stat64 info;
+	if (_stat64(path.c_str(), &info) != 0) return false;
+#else
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0) return false;
+#endif
+	size = (uint64_t)info.st_size;
+	mtime = (int64_t)info.st_mtime;
+	return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+// Read-only view of a whole file mapped in memory. Pages are read by the OS
+// when first touched, so opening is fast even for very large files
+class MappedFile {
+public:
+	MappedFile() {}
+	~MappedFile() { Close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// false if the file cannot be opened. An empty file is opened with no data
+	bool Open(const std::string& path);
+	void Close();
+
+	bool IsOpen() const { return open_; }
+	const char* Data() const { return data_; }
+	size_t Size() const { return size_; }
+
+	// size in bytes and last modification time in seconds, false if the file does not exist
+	static bool Stat(const std::string& path, uint64_t& size, int64_t& mtime);
+
+private:
+	const char* data_ = nullptr;
+	size_t size_ = 0;
+	bool open_ = false;
+#if defined(_WIN32)
+	void* file_ = nullptr; // HANDLE
+	void* mapping_ = nullptr;
+#endif
+};
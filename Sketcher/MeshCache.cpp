@@ -0,0 +1,293 @@
+#include "MeshCache.h"
+
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <GLFW\glfw3.h>
+
+#include "MappedFile.h"
+#include "Worker.h"
+#include "Log.h"
+#include "Trace.h"
+
+namespace {
+	const char magic[8] = { 'S', 'K', 'M', 'E', 'S', 'H', '\r', '\n' };
+	// increase whenever the layout or the cached data change
+	const uint32_t version = 1;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t options;
+		uint64_t source_size;
+		int64_t source_mtime;
+		uint64_t path_length;
+		uint64_t n_vertices;
+		uint64_t n_edges;
+		uint64_t n_faces;
+		double average_edge_length;
+	};
+
+	// every array starts 8 bytes aligned
+	size_t Align(size_t offset) { return (offset + 7) & ~size_t(7); }
+
+	// offsets of the arrays, after the header and the source path
+	struct Layout {
+		size_t vertex_halfedge;
+		size_t halfedge_vertex; // to vertex of every halfedge
+		size_t halfedge_next;
+		size_t halfedge_face;
+		size_t face_halfedge;
+		size_t points;
+		size_t vertex_normals;
+		size_t face_normals;
+		size_t halfedge_normals;
+		size_t dihedral_angles;
+		size_t total;
+
+		explicit Layout(const Header& header) {
+			const size_t nv = header.n_vertices, nh = 2 * header.n_edges, nf = header.n_faces;
+			size_t offset = Align(sizeof(Header) + header.path_length);
+			auto next = [&offset](size_t bytes) { const size_t start = offset; offset = Align(offset + bytes); return start; };
+			vertex_halfedge = next(nv * sizeof(int32_t));
+			halfedge_vertex = next(nh * sizeof(int32_t));
+			halfedge_next = next(nh * sizeof(int32_t));
+			halfedge_face = next(nh * sizeof(int32_t));
+			face_halfedge = next(nf * sizeof(int32_t));
+			points = next(nv * sizeof(MyMesh::Point));
+			vertex_normals = next(nv * sizeof(MyMesh::Normal));
+			face_normals = next(nf * sizeof(MyMesh::Normal));
+			halfedge_normals = next(nh * sizeof(MyMesh::Normal));
+			dihedral_angles = next(header.n_edges * sizeof(float));
+			total = offset;
+		}
+	};
+
+	// FNV-1a, names the snapshot of a source path
+	uint64_t HashPath(const std::string& path) {
+		uint64_t hash = 14695981039346656037ull;
+		for (const char c : path) {
+			hash ^= (unsigned char)c;
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	void MakeDirectory(const std::string& path) {
+#if defined(_WIN32)
+		_mkdir(path.c_str());
+#else
+		mkdir(path.c_str(), 0755);
+#endif
+	}
+
+	// the mapped pages are read while copying, so copy in parallel
+	void ParallelCopy(void* destination, const char* source, size_t bytes) {
+		Worker::ParallelChunks(0, bytes, [&](size_t, size_t begin, size_t end) {
+			memcpy((char*)destination + begin, source + begin, end - begin);
+		});
+	}
+
+	// writes zeros up to offset
+	bool PadTo(FILE* file, size_t offset) {
+		static const char zeros[8] = {};
+		const long position = ftell(file);
+		if (position < 0 || (size_t)position > offset) return false;
+		return fwrite(zeros, 1, offset - position, file) == offset - position;
+	}
+
+	// writes index(i) for i in [0, n) as int32, in blocks
+	template <typename Index>
+	bool WriteIndices(FILE* file, size_t n, const Index& index) {
+		std::vector<int32_t> block;
+		const size_t block_size = 1 << 16;
+		for (size_t begin = 0; begin < n; begin += block_size) {
+			const size_t end = std::min(n, begin + block_size);
+			block.resize(end - begin);
+			for (size_t i = begin; i < end; ++i) block[i - begin] = index(i);
+			if (fwrite(block.data(), sizeof(int32_t), block.size(), file) != block.size()) return false;
+		}
+		return true;
+	}
+
+	template <typename T>
+	bool WriteArray(FILE* file, const std::vector<T>& values) {
+		return fwrite(values.data(), sizeof(T), values.size(), file) == values.size();
+	}
+}
+
+std::string MeshCache::directory;
+
+bool MeshCache::MakeKey(const std::string& source, uint32_t options, Key& key) {
+	key.source = source;
+	key.options = options;
+	return MappedFile::Stat(source, key.size, key.mtime);
+}
+
+std::string MeshCache::SnapshotPath(const Key& key) {
+	if (directory.empty()) return key.source + ".cache";
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.mesh", (unsigned long long)HashPath(key.source));
+#if defined(_WIN32)
+	return directory + "\\" + name;
+#else
+	return directory + "/" + name;
+#endif
+}
+
+bool MeshCache::Load(const Key& key, MyMesh& mesh) {
+	TRACE_FUNCTION();
+	const double start = glfwGetTime();
+	MappedFile file;
+	if (!file.Open(SnapshotPath(key))) return false;
+
+	Header header;
+	if (file.Size() < sizeof(Header)) return false;
+	memcpy(&header, file.Data(), sizeof(Header));
+	const bool fresh = memcmp(header.magic, magic, sizeof(magic)) == 0 && header.version == version
+		&& header.options == key.options && header.source_size == key.size
+		&& header.source_mtime == key.mtime && header.path_length == key.source.size()
+		&& file.Size() >= sizeof(Header) + header.path_length
+		&& key.source.compare(0, std::string::npos, file.Data() + sizeof(Header), header.path_length) == 0;
+	if (!fresh) {
+		print("The cached mesh is stale\n");
+		return false;
+	}
+	const Layout layout(header);
+	if (file.Size() != layout.total || header.n_edges > INT32_MAX / 2) {
+		print(LogLevel::Warning, "The cached mesh is incomplete\n");
+		return false;
+	}
+	const int nv = (int)header.n_vertices, ne = (int)header.n_edges, nf = (int)header.n_faces;
+	const int nh = 2 * ne;
+	const char* data = file.Data();
+	const int32_t* vertex_halfedge = (const int32_t*)(data + layout.vertex_halfedge);
+	const int32_t* halfedge_vertex = (const int32_t*)(data + layout.halfedge_vertex);
+	const int32_t* halfedge_next = (const int32_t*)(data + layout.halfedge_next);
+	const int32_t* halfedge_face = (const int32_t*)(data + layout.halfedge_face);
+	const int32_t* face_halfedge = (const int32_t*)(data + layout.face_halfedge);
+
+	// a corrupt index would break the mesh later, invalid is -1
+	std::atomic<bool> valid(true);
+	auto check = [&valid](int32_t index, int n) { if (index < -1 || index >= n) valid = false; };
+	// halfedges that are the next of another one, two halfedges with the same next are corrupt
+	std::unique_ptr<std::atomic<bool>[]> is_next(new std::atomic<bool>[nh]());
+	mesh.resize(nv, ne, nf);
+	Worker::ParallelFor(0, nv, [&](size_t i) {
+		check(vertex_halfedge[i], nh);
+		mesh.set_halfedge_handle(VertexHandle((int)i), HalfedgeHandle(vertex_halfedge[i]));
+	});
+	// every halfedge is the next of at most one, so setting the previous ones does not overlap
+	Worker::ParallelFor(0, nh, [&](size_t i) {
+		const HalfedgeHandle he((int)i);
+		check(halfedge_vertex[i], nv);
+		check(halfedge_next[i], nh);
+		check(halfedge_face[i], nf);
+		if (!valid) return;
+		if (halfedge_next[i] >= 0 && is_next[halfedge_next[i]].exchange(true)) {
+			valid = false;
+			return;
+		}
+		mesh.set_vertex_handle(he, VertexHandle(halfedge_vertex[i]));
+		mesh.set_face_handle(he, FaceHandle(halfedge_face[i]));
+		if (halfedge_next[i] >= 0) mesh.set_next_halfedge_handle(he, HalfedgeHandle(halfedge_next[i]));
+	});
+	Worker::ParallelFor(0, nf, [&](size_t i) {
+		check(face_halfedge[i], nh);
+		mesh.set_halfedge_handle(FaceHandle((int)i), HalfedgeHandle(face_halfedge[i]));
+	});
+	if (!valid) {
+		print(LogLevel::Warning, "The cached mesh is corrupt\n");
+		mesh.clear();
+		return false;
+	}
+
+	ParallelCopy(mesh.property(mesh.points_pph()).data_vector().data(),
+		data + layout.points, nv * sizeof(MyMesh::Point));
+	ParallelCopy(mesh.property(mesh.vertex_normals_pph()).data_vector().data(),
+		data + layout.vertex_normals, nv * sizeof(MyMesh::Normal));
+	ParallelCopy(mesh.property(mesh.face_normals_pph()).data_vector().data(),
+		data + layout.face_normals, nf * sizeof(MyMesh::Normal));
+	ParallelCopy(mesh.property(mesh.halfedge_normals_pph()).data_vector().data(),
+		data + layout.halfedge_normals, nh * sizeof(MyMesh::Normal));
+	ParallelCopy(mesh.property(mesh.dihedral_angle_).data_vector().data(),
+		data + layout.dihedral_angles, ne * sizeof(float));
+
+	mesh.average_edge_length_ = header.average_edge_length;
+	mesh.sort_edges_by_angle();
+	mesh.features_valid_ = true;
+	mesh.update_feature_bits();
+
+	print("Read the cached mesh in %.2f s\n", glfwGetTime() - start);
+	return true;
+}
+
+bool MeshCache::Save(const Key& key, const MyMesh& mesh) {
+	TRACE_FUNCTION();
+	if (!directory.empty()) MakeDirectory(directory);
+	const std::string path = SnapshotPath(key);
+	const std::string temporary = path + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (!file) {
+		print(LogLevel::Warning, "Could not write the mesh cache %s\n", temporary.c_str());
+		return false;
+	}
+
+	Header header;
+	memcpy(header.magic, magic, sizeof(magic));
+	header.version = version;
+	header.options = key.options;
+	header.source_size = key.size;
+	header.source_mtime = key.mtime;
+	header.path_length = key.source.size();
+	header.n_vertices = mesh.n_vertices();
+	header.n_edges = mesh.n_edges();
+	header.n_faces = mesh.n_faces();
+	header.average_edge_length = mesh.average_edge_length();
+	const Layout layout(header);
+	const size_t nh = mesh.n_halfedges();
+
+	bool ok = fwrite(&header, sizeof(Header), 1, file) == 1
+		&& fwrite(key.source.data(), 1, key.source.size(), file) == key.source.size();
+	ok = ok && PadTo(file, layout.vertex_halfedge) && WriteIndices(file, mesh.n_vertices(),
+		[&mesh](size_t i) { return mesh.halfedge_handle(VertexHandle((int)i)).idx(); });
+	ok = ok && PadTo(file, layout.halfedge_vertex) && WriteIndices(file, nh,
+		[&mesh](size_t i) { return mesh.to_vertex_handle(HalfedgeHandle((int)i)).idx(); });
+	ok = ok && PadTo(file, layout.halfedge_next) && WriteIndices(file, nh,
+		[&mesh](size_t i) { return mesh.next_halfedge_handle(HalfedgeHandle((int)i)).idx(); });
+	ok = ok && PadTo(file, layout.halfedge_face) && WriteIndices(file, nh,
+		[&mesh](size_t i) { return mesh.face_handle(HalfedgeHandle((int)i)).idx(); });
+	ok = ok && PadTo(file, layout.face_halfedge) && WriteIndices(file, mesh.n_faces(),
+		[&mesh](size_t i) { return mesh.halfedge_handle(FaceHandle((int)i)).idx(); });
+	ok = ok && PadTo(file, layout.points) && WriteArray(file, mesh.property(mesh.points_pph()).data_vector());
+	ok = ok && PadTo(file, layout.vertex_normals) && WriteArray(file, mesh.property(mesh.vertex_normals_pph()).data_vector());
+	ok = ok && PadTo(file, layout.face_normals) && WriteArray(file, mesh.property(mesh.face_normals_pph()).data_vector());
+	ok = ok && PadTo(file, layout.halfedge_normals) && WriteArray(file, mesh.property(mesh.halfedge_normals_pph()).data_vector());
+	ok = ok && PadTo(file, layout.dihedral_angles) && WriteArray(file, mesh.property(mesh.dihedral_angle_).data_vector());
+	ok = ok && PadTo(file, layout.total);
+	ok = fclose(file) == 0 && ok;
+
+	// rename does not replace an existing file everywhere
+	remove(path.c_str());
+	if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+		remove(temporary.c_str());
+		print(LogLevel::Warning, "Could not write the mesh cache %s\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void MeshCache::SaveAsync(const Key& key, std::shared_ptr<const MyMesh> mesh) {
+	Worker::Do([key, mesh]() {
+		if (Save(key, *mesh)) print("Cached the mesh for faster reloading\n");
+	}, Priority::Low, "Write mesh cache");
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <stdint.h>
+
+#include "MyMesh.h"
+
+// Binary snapshots of loaded meshes, so reloading a large file skips parsing,
+// moving, normalizing and initializing it. A snapshot holds the connectivity,
+// points, normals, dihedral angles and average edge length, in the layout of
+// the mesh arrays, and is read back through a memory mapping. The restored
+// normals and angles are used as they are, the upload does not recompute them.
+// It is only used if the source file has the same size and modification time
+// and the mesh was loaded with the same options.
+class MeshCache {
+public:
+	// options that change the loaded mesh
+	enum Options {
+		MoveToOrigin = 1,
+		Normalize = 2,
+	};
+
+	// identifies the source of a snapshot
+	struct Key {
+		std::string source;
+		uint64_t size = 0;
+		int64_t mtime = 0;
+		uint32_t options = 0;
+	};
+
+	// false if the source file does not exist
+	static bool MakeKey(const std::string& source, uint32_t options, Key& key);
+
+	// Fills the mesh, which must be empty, from the snapshot of the key.
+	// False if there is none or it is stale, in which case the mesh is untouched.
+	// Of the possible corruptions, only indices out of range and halfedges
+	// sharing a next halfedge are detected
+	static bool Load(const Key& key, MyMesh& mesh);
+
+	// Writes the snapshot of a freshly loaded mesh, without deleted elements.
+	// The file is replaced at the end, so a failed write leaves no broken snapshot
+	static bool Save(const Key& key, const MyMesh& mesh);
+	// same, as a low priority task. The mesh is shared, not copied, so it must not change
+	static void SaveAsync(const Key& key, std::shared_ptr<const MyMesh> mesh);
+
+	// where snapshots are written, one per source path. Empty for next to the source
+	static std::string directory;
+
+private:
+	static std::string SnapshotPath(const Key& key);
+};
@@ -1,31 +1,274 @@
 #include "MyMesh.h"
+#include "Trace.h"
 
 #include <iostream>
 #include <vector>
+#include <limits>
+#include <numeric>
+#include <algorithm>
 
 MyMesh mesh_;
-MyMesh backup_;
+std::shared_ptr<const MyMesh> backup_ = std::make_shared<MyMesh>();
 const MyMesh& cmesh() { return mesh_; }
-const MyMesh& cbackup() { return backup_; }
+const MyMesh& cbackup() { return *backup_; }
 MyMesh& mesh() { return mesh_; }
-void DoBackup() { backup_ = mesh_; }
-void RestoreBackup() { mesh_ = backup_; }
+void DoBackup() { backup_ = std::make_shared<MyMesh>(mesh_); }
+void SetBackup(std::shared_ptr<const MyMesh> backup) { backup_ = std::move(backup); }
+void RestoreBackup() { mesh_ = *backup_; }
+
+namespace {
+	// an edge is a feature if dot(n0, n1) < cos(max_angle), which is the same as
+	// acos(dot(n0, n1)) > acos(cos(max_angle)), also for angles past 180 degrees
+	float feature_angle_threshold(float degrees) {
+		return (float)std::acos(std::cos(Utils::ToRad((double)degrees)));
+	}
+
+	struct BoundingBox {
+		Vec3d min;
+		Vec3d max;
+	};
+
+	BoundingBox compute_bounding_box(const MyMesh& mesh) {
+		const Vec3d first = mesh.point(VertexHandle(0));
+		return Worker::ParallelReduce(0, mesh.n_vertices(), BoundingBox{ first, first },
+			[&mesh](size_t i) {
+			const Vec3d& p = mesh.point(VertexHandle((int)i));
+			return BoundingBox{ p, p };
+		}, [](BoundingBox a, const BoundingBox& b) {
+			a.min.minimize(b.min);
+			a.max.maximize(b.max);
+			return a;
+		});
+	}
+}
 
 void MyMesh::initialize() {
-	update_face_normals();
-	update_vertex_normals();
-	calc_average_edge_length();
+	TRACE_FUNCTION();
+	// stages that do not depend on each other run at the same time
+	TaskFuture<void> face_normals = Worker::Submit([this]() { 
+		update_face_normals_parallel(); }, {}, "Face normals");
+	TaskFuture<void> vertex_normals = Worker::Submit([this]() { 
+		update_vertex_normals_parallel(); }, { face_normals }, "Vertex normals");
+	TaskFuture<void> halfedge_normals = Worker::Submit([this]() { 
+		update_halfedge_normals_parallel(); }, { face_normals }, "Halfedge normals");
+	TaskFuture<void> features = Worker::Submit([this]() { 
+		update_features(); }, { face_normals }, "Features");
+	TaskFuture<double> edge_length = Worker::Submit([this]() { 
+		return calc_average_edge_length(); }, {}, "Edge length");
+	vertex_normals.Wait();
+	halfedge_normals.Wait();
+	features.Wait();
+	edge_length.Wait();
+}
+
+void MyMesh::update_normals_parallel() {
+	// same as OpenMesh update_normals(): face normals first, the others depend on them
+	update_face_normals_parallel();
+	update_vertex_normals_parallel();
+	update_halfedge_normals_parallel();
+}
+
+void MyMesh::update_face_normals_parallel() {
+	parallel_faces([this](const FaceHandle f) {
+		set_normal(f, calc_face_normal(f));
+	});
+}
+
+void MyMesh::update_vertex_normals_parallel() {
+	parallel_vertices([this](const VertexHandle v) {
+		set_normal(v, calc_vertex_normal(v));
+	});
+}
+
+void MyMesh::update_halfedge_normals_parallel() {
+	parallel_halfedges([this](const HalfedgeHandle he) {
+		set_normal(he, calc_halfedge_normal(he));
+	});
+}
+
+void MyMesh::update_face_normals_parallel(const std::vector<FaceHandle>& faces) {
+	Worker::ParallelFor(0, faces.size(), [&](size_t i) {
+		set_normal(faces[i], calc_face_normal(faces[i]));
+	});
+}
+
+void MyMesh::update_vertex_normals_parallel(const std::vector<VertexHandle>& vertices) {
+	Worker::ParallelFor(0, vertices.size(), [&](size_t i) {
+		set_normal(vertices[i], calc_vertex_normal(vertices[i]));
+	});
+}
+
+void MyMesh::update_halfedge_normals_parallel(const std::vector<HalfedgeHandle>& halfedges) {
+	Worker::ParallelFor(0, halfedges.size(), [&](size_t i) {
+		set_normal(halfedges[i], calc_halfedge_normal(halfedges[i]));
+	});
 }
 
 double MyMesh::calc_average_edge_length() {
-	average_edge_length_ = 0;
-	for (const EdgeHandle e : cmesh().edges()) {
-		average_edge_length_ += calc_edge_length(cmesh().halfedge_handle(e, 0));
-	}
-	average_edge_length_ /= n_edges();
+	const double total = Worker::ParallelReduce(0, n_edges(), 0.0,
+		[this](size_t i) { return calc_edge_length(halfedge_handle(EdgeHandle((int)i), 0)); },
+		[](double a, double b) { return a + b; });
+	average_edge_length_ = total / n_edges();
 	return average_edge_length_;
 }
 
+float MyMesh::calc_dihedral_angle(const EdgeHandle e) const {
+	if (status(e).feature()) return std::numeric_limits<float>::infinity();
+	if (is_boundary(e)) return 0.0f;
+	const HalfedgeHandle he = halfedge_handle(e, 0);
+	const Vec3d& n0 = normal(face_handle(he));
+	const Vec3d& n1 = normal(face_handle(opposite_halfedge_handle(he)));
+	const double dot = std::min(1.0, std::max(-1.0, OpenMesh::dot(n0, n1)));
+	return (float)std::acos(dot);
+}
+
+void MyMesh::update_features() {
+	parallel_edges([this](const EdgeHandle e) {
+		property(dihedral_angle_, e) = calc_dihedral_angle(e);
+	});
+	// sorted here, in the Features stage of initialize(), so changing the threshold stays fast
+	sort_edges_by_angle();
+	features_valid_ = true;
+	update_feature_bits();
+}
+
+bool MyMesh::update_features(const std::vector<EdgeHandle>& edges) {
+	if (!features_cached()) {
+		update_features();
+		return false;
+	}
+	// the bits are for feature_bits_angle_, see is_feature()
+	const float threshold = feature_angle_threshold(feature_bits_angle_);
+	std::vector<float> angles(edges.size());
+	std::atomic<bool> flipped(false);
+	Worker::ParallelFor(0, edges.size(), [&](size_t i) {
+		angles[i] = calc_dihedral_angle(edges[i]);
+		if ((angles[i] > threshold) != feature_[edges[i].idx()]) flipped = true;
+	});
+	set_dihedral_angles(edges, angles);
+	if (flipped) {
+		update_feature_bits();
+		return false;
+	}
+	return true;
+}
+
+bool MyMesh::set_feature_max_angle(float degrees, std::vector<EdgeHandle>& changed) {
+	if (!features_cached()) {
+		feature_max_angle = degrees;
+		return false;
+	}
+
+	// features are the edges with angle > threshold, so the ones that change 
+	// are in (lower threshold, higher threshold], a contiguous block of the sorted edges
+	const float old_threshold = feature_angle_threshold(feature_bits_angle_);
+	const float new_threshold = feature_angle_threshold(degrees);
+	const float lower = std::min(old_threshold, new_threshold);
+	const float higher = std::max(old_threshold, new_threshold);
+	auto by_angle = [this](float angle, int e) { return angle < property(dihedral_angle_, EdgeHandle(e)); };
+	auto first = std::upper_bound(edges_by_angle_.begin(), edges_by_angle_.end(), lower, by_angle);
+	auto last = std::upper_bound(first, edges_by_angle_.end(), higher, by_angle);
+
+	const bool now_feature = new_threshold < old_threshold;
+	for (auto it = first; it != last; ++it) {
+		feature_[*it] = now_feature;
+		changed.push_back(EdgeHandle(*it));
+	}
+	feature_max_angle = degrees;
+	feature_bits_angle_ = degrees;
+	return true;
+}
+
+void MyMesh::set_dihedral_angles(const std::vector<EdgeHandle>& edges, const std::vector<float>& angles) {
+	if (edges.empty()) return;
+	// places in the list, searched while every angle is still the old one: where each
+	// edge is, and before which entry it goes with its new angle
+	auto before = [this](int entry, const std::pair<float, int>& key) {
+		const float angle = property(dihedral_angle_, EdgeHandle(entry));
+		return angle < key.first || (angle == key.first && entry < key.second);
+	};
+	std::vector<size_t> removed(edges.size());
+	std::vector<std::pair<size_t, int>> inserted(edges.size());
+	Worker::ParallelFor(0, edges.size(), [&](size_t i) {
+		const int e = edges[i].idx();
+		removed[i] = std::lower_bound(edges_by_angle_.begin(), edges_by_angle_.end(),
+			std::make_pair(property(dihedral_angle_, edges[i]), e), before) - edges_by_angle_.begin();
+		inserted[i].first = std::lower_bound(edges_by_angle_.begin(), edges_by_angle_.end(),
+			std::make_pair(angles[i], e), before) - edges_by_angle_.begin();
+		inserted[i].second = e;
+	});
+	Worker::ParallelFor(0, edges.size(), [&](size_t i) {
+		property(dihedral_angle_, edges[i]) = angles[i];
+	});
+	std::sort(removed.begin(), removed.end());
+	std::sort(inserted.begin(), inserted.end(), [this](const std::pair<size_t, int>& a, const std::pair<size_t, int>& b) {
+		return a.first < b.first || (a.first == b.first && angle_less(a.second, b.second));
+	});
+
+	// only the entries between the first and the last place move
+	const size_t begin = std::min(removed.front(), inserted.front().first);
+	const size_t end = std::max(removed.back() + 1, inserted.back().first);
+	std::vector<int> moved;
+	moved.reserve(end - begin);
+	for (size_t i = begin, next_removed = 0, next_inserted = 0; ; ++i) {
+		while (next_inserted < inserted.size() && inserted[next_inserted].first == i) {
+			moved.push_back(inserted[next_inserted++].second);
+		}
+		if (i == end) break;
+		if (next_removed < removed.size() && removed[next_removed] == i) {
+			++next_removed;
+		} else {
+			moved.push_back(edges_by_angle_[i]);
+		}
+	}
+	std::copy(moved.begin(), moved.end(), edges_by_angle_.begin() + begin);
+}
+
+void MyMesh::sort_edges_by_angle() {
+	edges_by_angle_.resize(n_edges());
+	std::iota(edges_by_angle_.begin(), edges_by_angle_.end(), 0);
+	auto by_angle = [this](int a, int b) { return angle_less(a, b); };
+
+	// sort chunks in parallel, then merge pairs of sorted chunks until one is left
+	const size_t n_chunks = Worker::ChunkCount(edges_by_angle_.size());
+	std::vector<size_t> bounds(n_chunks + 1, edges_by_angle_.size());
+	Worker::ParallelChunks(0, edges_by_angle_.size(), n_chunks, [&](size_t chunk, size_t begin, size_t end) {
+		bounds[chunk] = begin;
+		std::sort(edges_by_angle_.begin() + begin, edges_by_angle_.begin() + end, by_angle);
+	});
+	for (size_t width = 1; width < n_chunks; width *= 2) {
+		const size_t n_merges = (n_chunks + 2 * width - 1) / (2 * width);
+		Worker::ParallelFor(0, n_merges, [&](size_t i) {
+			const size_t first = 2 * width * i;
+			const size_t middle = std::min(first + width, n_chunks);
+			const size_t last = std::min(first + 2 * width, n_chunks);
+			std::inplace_merge(edges_by_angle_.begin() + bounds[first],
+				edges_by_angle_.begin() + bounds[middle],
+				edges_by_angle_.begin() + bounds[last], by_angle);
+		});
+	}
+}
+
+void MyMesh::update_feature_bits() {
+	const float threshold = feature_angle_threshold(feature_max_angle);
+	feature_.resize(n_edges());
+	for (size_t i = 0; i < n_edges(); ++i) {
+		feature_[i] = property(dihedral_angle_, EdgeHandle((int)i)) > threshold;
+	}
+	feature_bits_angle_ = feature_max_angle;
+}
+
+bool MyMesh::is_feature(const EdgeHandle e) const {
+	if (!features_cached()) {
+		return is_estimated_feature_edge(halfedge_handle(e, 0), Utils::ToRad(feature_max_angle));
+	}
+	if (feature_bits_angle_ == feature_max_angle) {
+		return feature_[e.idx()];
+	}
+	// feature_max_angle was changed directly, the angles are still good
+	return property(dihedral_angle_, e) > feature_angle_threshold(feature_max_angle);
+}
+
 bool MyMesh::is_on_feature(const VertexHandle v) const {
 	for (EdgeHandle e : ve_range(v)) {
 		if (is_feature(e)) return true;
@@ -136,38 +379,30 @@ HalfedgeHandle MyMesh::halfedge_between(const VertexHandle from, const VertexHan
 
 
 OpenMesh::Vec3d MyMesh::compute_center() const {
-	OpenMesh::Vec3d bbMin, bbMax;
-	bbMin = bbMax = point(VertexHandle(0));
-	for (VertexHandle v : vertices()) {
-		bbMin.minimize(point(v));
-		bbMax.maximize(point(v));
-	}
-	return (bbMin + bbMax) / 2;
+	const BoundingBox bb = compute_bounding_box(*this);
+	return (bb.min + bb.max) / 2;
 }
 
 double MyMesh::compute_size() const {
-	OpenMesh::Vec3d bbMin, bbMax;
-	bbMin = bbMax = point(VertexHandle(0));
-	for (VertexHandle v : vertices()) {
-		bbMin.minimize(point(v));
-		bbMax.maximize(point(v));
-	}
-	OpenMesh::Vec3d diag = (bbMin - bbMax);
+	const BoundingBox bb = compute_bounding_box(*this);
+	OpenMesh::Vec3d diag = (bb.min - bb.max);
 	return diag.norm();
 }
 
 void MyMesh::move_to_origin() {
 	const OpenMesh::Vec3d center = compute_center();
-	for (VertexHandle v : vertices()) {
+	parallel_vertices([this, &center](const VertexHandle v) {
 		point(v) -= center;
-	}
+	});
+	invalidate_features();
 }
 
 void MyMesh::normalize() {
 	const double scale = compute_size();
-	for (VertexHandle v : vertices()) {
+	parallel_vertices([this, scale](const VertexHandle v) {
 		set_point(v, point(v) / scale);
-	}
+	});
+	invalidate_features();
 }
 
 OpenMesh::Vec3d MyMesh::normal(const FaceHandle f) const {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 
 #include <OpenMesh/Core/IO/MeshIO.hh>
 #include <OpenMesh/Core/Mesh/Handles.hh>
@@ -9,6 +10,7 @@
 
 #include "Color.h"
 #include "Utils.h"
+#include "Worker.h"
 
 // if the cosine of the angle between normals of 
 // two adjacent faces is greater than this, then 
@@ -37,18 +39,39 @@ struct MyTraits : public OpenMesh::DefaultTraits {
 
 class MyMesh : public OpenMesh::PolyMesh_ArrayKernelT<MyTraits> {
 public:
-	MyMesh() {}
+	MyMesh() { add_property(dihedral_angle_); }
 
 	float feature_max_angle = 45.0f;
 	bool render_ready = false;
 
     void initialize();
+
+	// face, vertex and halfedge normals, same as update_normals() but in parallel
+	void update_normals_parallel();
+	void update_face_normals_parallel();
+	// these two need the face normals
+	void update_vertex_normals_parallel();
+	void update_halfedge_normals_parallel();
+	// same, only for the given elements, e.g. around a few moved vertices
+	void update_face_normals_parallel(const std::vector<FaceHandle>& faces);
+	void update_vertex_normals_parallel(const std::vector<VertexHandle>& vertices);
+	void update_halfedge_normals_parallel(const std::vector<HalfedgeHandle>& halfedges);
+
+	// ==== Parallel loops ====
+	// calls f(handle) for every element, on all cores (see Worker::ParallelFor)
+	template <typename F> void parallel_vertices(const F& f) const {
+		Worker::ParallelFor(0, n_vertices(), [&f](size_t i) { f(VertexHandle((int)i)); }); }
+	template <typename F> void parallel_edges(const F& f) const {
+		Worker::ParallelFor(0, n_edges(), [&f](size_t i) { f(EdgeHandle((int)i)); }); }
+	template <typename F> void parallel_faces(const F& f) const {
+		Worker::ParallelFor(0, n_faces(), [&f](size_t i) { f(FaceHandle((int)i)); }); }
+	template <typename F> void parallel_halfedges(const F& f) const {
+		Worker::ParallelFor(0, n_halfedges(), [&f](size_t i) { f(HalfedgeHandle((int)i)); }); }
     
 	// ==== General Queries ====
-	bool is_feature(const EdgeHandle e) const {
-		return is_feature(halfedge_handle(e, 0)); }
+	bool is_feature(const EdgeHandle e) const;
 	bool is_feature(const HalfedgeHandle he) const { 
-		return is_estimated_feature_edge(he, Utils::ToRad(feature_max_angle)); }
+		return is_feature(edge_handle(he)); }
 	bool is_on_feature(const VertexHandle v) const;
 	bool is_across_feature(const HalfedgeHandle in, const HalfedgeHandle out) const;
 
@@ -95,6 +118,33 @@ public:
 	// returns a score where 0 is perfectly straight, higher is more curved
 	double surface_angle_score(const HalfedgeHandle in, const HalfedgeHandle out) const;
     
+	// ==== Feature edges ====
+	// Caches the dihedral angle of every edge and which edges are features for
+	// the current feature_max_angle. Needs up to date face normals, call again
+	// whenever the geometry changes. Without the cache is_feature() is slower.
+	void update_features();
+	// Updates the cache for the given edges only, after their faces moved.
+	// Returns false if any of them started or stopped being a feature, or if
+	// there was no cache to update
+	bool update_features(const std::vector<EdgeHandle>& edges);
+	// Call after moving vertices without updating the normals and the cache,
+	// the next full upload then recomputes both
+	void invalidate_features() { features_valid_ = false; }
+	// True if the normals and the feature cache match the current positions
+	bool features_cached() const { return features_valid_ && feature_.size() == n_edges(); }
+	// Changes feature_max_angle and updates the cached feature edges.
+	// Only the edges with angle between the old and new threshold change, they
+	// are added to changed. Returns false if there is no cache to update, 
+	// in which case any edge may have changed.
+	bool set_feature_max_angle(float degrees, std::vector<EdgeHandle>& changed);
+	bool set_feature_max_angle(float degrees) {
+		std::vector<EdgeHandle> changed;
+		return set_feature_max_angle(degrees, changed);
+	}
+	// Angle between the normals of the two faces of the edge, in radians.
+	// 0 on boundaries, infinity for edges tagged as feature. Needs update_features()
+	float dihedral_angle(const EdgeHandle e) const { return property(dihedral_angle_, e); }
+
     // computes the average edge length across the whole mesh
 	double calc_average_edge_length();
 	double average_edge_length() const { return average_edge_length_; }
@@ -118,9 +168,32 @@ public:
 
 	// Moves the mesh to the origin
 	// such that at the end center() = (0, 0, 0)
+	// This and normalize() invalidate the features
 	void move_to_origin();
 
 	double average_edge_length_ = 0;
+
+private:
+	friend class MeshCache; // restores the cached data
+
+	void update_feature_bits();
+	float calc_dihedral_angle(const EdgeHandle e) const;
+	// edges_by_angle_ order: by angle, then by index so every edge has one place
+	bool angle_less(int a, int b) const {
+		const float angle_a = property(dihedral_angle_, EdgeHandle(a));
+		const float angle_b = property(dihedral_angle_, EdgeHandle(b));
+		return angle_a < angle_b || (angle_a == angle_b && a < b);
+	}
+	void sort_edges_by_angle();
+	// sets the angles of the given edges and moves them to their new place in edges_by_angle_
+	void set_dihedral_angles(const std::vector<EdgeHandle>& edges, const std::vector<float>& angles);
+
+	OpenMesh::EPropHandleT<float> dihedral_angle_;
+	std::vector<bool> feature_;
+	// edge indices sorted by dihedral angle, kept with the angles while features_cached()
+	std::vector<int> edges_by_angle_;
+	float feature_bits_angle_ = -1.0f; // feature_max_angle used to compute feature_
+	bool features_valid_ = false;
 };
 
 
@@ -132,6 +205,8 @@ const MyMesh& cmesh();
 const MyMesh& cbackup();
 MyMesh& mesh();
 void DoBackup();
+// Makes the mesh the backup without copying it, it must not change afterwards
+void SetBackup(std::shared_ptr<const MyMesh> backup);
 void RestoreBackup();
 
 // ---- data structures ----
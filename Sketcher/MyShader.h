@@ -2,10 +2,13 @@
 
 #include <string>
 #include <functional>
+#include <algorithm>
 
 #include "GLShader.h"
 #include "Color.h"
 #include "MyMesh.h"
+#include "Utils.h"
+#include "Worker.h"
 
 class BasicShader : public GLShader {
 public:
@@ -18,6 +21,7 @@ public:
 		const std::string vert_file = folder + vert + ".vert";
 		const std::string frag_file = folder + frag + ".frag";
 		const std::string geom_file = folder + geom + ".geom";
+		PrependFile(folder + "common.glsl");
 		InitFromFiles(vert_file, frag_file, geom_file);
 		updated_ = true;
 	}
@@ -27,21 +31,142 @@ public:
 
 	void SetRenderFunc(const std::function<void()> render) { render_ = render; };
 	void Render() { render_(); }
+	// Draws the uploaded primitives, the shader must be bound
+	virtual void Draw() { DrawArray(); }
 
 	void Invalidate() { updated_ = false; }
 	virtual void Update() { updated_ = true; }
+	// false after Invalidate until the next Update
+	bool Updated() const { return updated_; }
+
+	// Upload colors as normalized RGBA bytes instead of floats, a quarter of the size
+	void SetRgba8Colors(bool rgba8) {
+		if (rgba8 == rgba8_colors_) return;
+		rgba8_colors_ = rgba8;
+		FreeAttrib("vert_color");
+		Invalidate();
+	}
 
 protected:
+	// uploads vert_color, the shader must be bound
+	void UploadColors(const Eigen::Matrix4Xf& colors) {
+		if (rgba8_colors_) {
+			UploadAttrib("vert_color", ToRgba8(colors));
+		} else {
+			UploadAttrib("vert_color", colors);
+		}
+	}
+	void UploadColorsRange(const Eigen::Matrix4Xf& colors, uint32_t first_column) {
+		if (rgba8_colors_) {
+			UploadAttribRange("vert_color", ToRgba8(colors), first_column);
+		} else {
+			UploadAttribRange("vert_color", colors, first_column);
+		}
+	}
+
+	static Eigen::Matrix<uint8_t, 4, Eigen::Dynamic> ToRgba8(const Eigen::Matrix4Xf& colors) {
+		Eigen::Matrix<uint8_t, 4, Eigen::Dynamic> bytes(4, colors.cols());
+		Worker::ParallelFor(0, (size_t)colors.size(), [&](size_t i) {
+			const float c = std::min(std::max(colors.data()[i], 0.0f), 1.0f);
+			bytes.data()[i] = uint8_t(c * 255.0f + 0.5f);
+		});
+		return bytes;
+	}
+
 	bool updated_;
+	bool rgba8_colors_ = false;
 	std::function<void()> render_;
 };
 
-class FaceShader : public BasicShader {
+// Colors of all the elements at once, instead of calling a function per element.
+// Either fills the colors as they are drawn: one column per face, two per edge 
+// and halfedge (one per end). Or gives a value per element, mapped to a colormap
+class BulkColors {
+public:
+	using FillFunc = std::function<void(Eigen::Matrix4Xf& colors)>;
+	using ValueFunc = std::function<void(Eigen::VectorXf& values)>;
+
+	bool Active() const { return fill_ || values_; }
+	void Clear() {
+		fill_ = nullptr;
+		values_ = nullptr;
+	}
+	void SetFill(const FillFunc f) {
+		Clear();
+		fill_ = f;
+	}
+	// values in [min, max] go through the whole colormap. If min >= max 
+	// the range of the values is used instead
+	void SetValues(const ValueFunc f, const Colormap& colormap, float min, float max) {
+		Clear();
+		values_ = f;
+		colormap_ = colormap;
+		min_ = min;
+		max_ = max;
+	}
+
+	// colors of n elements with ends columns each
+	void Get(size_t n, size_t ends, Eigen::Matrix4Xf& colors) const {
+		colors.resize(4, n * ends);
+		if (fill_) {
+			fill_(colors);
+			return;
+		}
+		Eigen::VectorXf values(n);
+		values_(values);
+		if (n == 0) return;
+		float min = min_;
+		float max = max_;
+		if (min >= max) {
+			min = values.minCoeff();
+			max = values.maxCoeff();
+		}
+		const float scale = max > min ? 1.0f / (max - min) : 0.0f;
+		Worker::ParallelFor(0, n, [&](size_t i) {
+			const auto color = colormap_.Map((values[i] - min) * scale);
+			for (size_t end = 0; end < ends; ++end) {
+				colors.col(i * ends + end) = color;
+			}
+		});
+	}
+
+private:
+	FillFunc fill_;
+	ValueFunc values_;
+	Colormap colormap_ = Colormap::Rainbow();
+	float min_ = 0.0f;
+	float max_ = 0.0f;
+};
+
+// Shader colored per mesh element, with a function per element or in bulk
+class ElementShader : public BasicShader {
+public:
+	ElementShader(const std::string vert,
+		const std::string frag,
+		const std::string geom)
+		: BasicShader(vert, frag, geom) {}
+
+	// Replaces the color function until SetColorFunc is called again
+	void SetColors(const BulkColors::FillFunc f) {
+		bulk_.SetFill(f);
+		Invalidate();
+	}
+	void SetColorValues(const BulkColors::ValueFunc f, const Colormap& colormap = Colormap::Rainbow(),
+		float min = 0.0f, float max = 0.0f) {
+		bulk_.SetValues(f, colormap, min, max);
+		Invalidate();
+	}
+
+protected:
+	BulkColors bulk_;
+};
+
+class FaceShader : public ElementShader {
 public:
 	FaceShader(const std::string vert,
 		const std::string frag, 
 		const std::string geom)
-		: BasicShader(vert, frag, geom),
+		: ElementShader(vert, frag, geom),
 		face_color_([](const FaceHandle f, const VertexHandle v) { return Color::Empty(); }) {}
 	FaceShader(const std::string vert, 
 		const std::string frag)
@@ -50,41 +175,35 @@ public:
 	void Update() override {
 		if (updated_) return;
 		updated_ = true;
-		size_t i = 0; // triangle vertex index;
-		size_t n_triangles = 0;
-		for (const FaceHandle f : cmesh().faces()) {
-			const size_t face_triangles = cmesh().valence(f) - 2;
-			n_triangles += face_triangles;
-		}
-		Eigen::Matrix4Xf face_colors(4, n_triangles * 3);
-		for (const FaceHandle f : cmesh().faces()) {
-			const size_t face_triangles = cmesh().valence(f) - 2;
-			//// vertex colors version:
-			//MyMesh::ConstFaceVertexCCWIter it = cmesh().cfv_ccwbegin(f);
-			//VertexHandle first = *it;
-			//++it;
-			//for (int j = 0; j < face_triangles; ++j) {
-			//	face_colors.col(i + 0) = face_color_(f, first);
-			//	face_colors.col(i + 1) = face_color_(f, *it);
-			//	++it;
-			//	face_colors.col(i + 2) = face_color_(f, *it);
-			//	i += 3;
-			//}
-
-			// uniform color version
-			Color color = face_color_(f, VertexHandle(-1));
-			for (size_t j = 0; j < face_triangles * 3; ++j) {
-				face_colors.col(i + j) = color;
+		const size_t n_faces = cmesh().n_faces();
+		Eigen::Matrix4Xf colors; // one per face
+		if (bulk_.Active()) {
+			bulk_.Get(n_faces, 1, colors);
+		} else {
+			colors.resize(4, n_faces);
+			for (const FaceHandle f : cmesh().faces()) {
+				colors.col(f.idx()) = face_color_(f, VertexHandle(-1));
 			}
-			i += 3 * face_triangles;
 		}
-		assert(i == n_triangles * 3);
+
+		// every corner of the triangles of a face gets its color
+		std::vector<size_t> first_triangle;
+		Worker::ParallelPrefixSum(n_faces, first_triangle, [](size_t f) {
+			return size_t(cmesh().valence(FaceHandle((int)f)) - 2);
+		});
+		Eigen::Matrix4Xf face_colors(4, first_triangle.back() * 3);
+		Worker::ParallelFor(0, n_faces, [&](size_t f) {
+			for (size_t i = 3 * first_triangle[f]; i < 3 * first_triangle[f + 1]; ++i) {
+				face_colors.col(i) = colors.col(f);
+			}
+		});
 		Bind();
-		UploadAttrib("vert_color", face_colors);
+		UploadColors(face_colors);
 	}
 
 	void SetColorFunc(const std::function<Color(const FaceHandle f, const VertexHandle v)> f) {
 		face_color_ = f;
+		bulk_.Clear();
 		Invalidate();
 	}
 
@@ -92,47 +211,133 @@ private:
 	std::function<Color(const FaceHandle f, const VertexHandle v)> face_color_;
 };
 
-class EdgeShader : public BasicShader {
+class EdgeShader : public ElementShader {
 public:
 	EdgeShader(const std::string vert,
 		const std::string frag, 
 		const std::string geom)
-		: BasicShader(vert, frag, geom), 
+		: ElementShader(vert, frag, geom), 
 		edge_color_([](const EdgeHandle, const unsigned int direction) { return Color::Empty(); }) {}
 	EdgeShader(const std::string vert, 
 		const std::string frag)
 		: EdgeShader(vert, frag, "") {}
 
 	void Update() override {
-		if (updated_) return;
+		if (updated_) {
+			if (!dirty_edges_.empty()) UpdateEdges();
+			return;
+		}
 		updated_ = true;
-		size_t i = 0; // line index;
-		Eigen::Matrix4Xf line_colors(4, cmesh().n_edges() * 2);
-		for (const EdgeHandle e : cmesh().edges()) {
-			line_colors.col(i + 0) = edge_color_(e, 0);
-			line_colors.col(i + 1) = edge_color_(e, 1);
-			i += 2;
+		dirty_edges_.clear();
+		const size_t n_edges = cmesh().n_edges();
+		Eigen::Matrix4Xf line_colors;
+		if (bulk_.Active()) {
+			bulk_.Get(n_edges, 2, line_colors);
+		} else {
+			line_colors.resize(4, n_edges * 2);
+			for (const EdgeHandle e : cmesh().edges()) {
+				line_colors.col(2 * e.idx() + 0) = edge_color_(e, 0);
+				line_colors.col(2 * e.idx() + 1) = edge_color_(e, 1);
+			}
+		}
+		visible_.resize(n_edges);
+		for (size_t e = 0; e < n_edges; ++e) {
+			visible_[e] = line_colors(3, 2 * e) > 0.0f || line_colors(3, 2 * e + 1) > 0.0f;
 		}
-		assert(i == cmesh().n_edges() * 2);
 		Bind();
-		UploadAttrib("vert_color", line_colors);
+		UploadColors(line_colors);
+		UploadVisible();
+	}
+
+	// Only the edges with some color are drawn, from a compact index buffer
+	void Draw() override {
+		if (compact_ && compact_draw_) {
+			DrawIndexed(GL_LINES, 0, n_visible_);
+		} else {
+			DrawArray();
+		}
+	}
+
+	// Draws all the edges if false, even the transparent ones. For comparisons
+	void SetCompactDraw(bool compact) { compact_draw_ = compact; }
+	size_t NumVisible() const { return n_visible_; }
+
+	using BasicShader::Invalidate;
+	// Only re-uploads the colors of the given edges in the next Update
+	void Invalidate(const std::vector<EdgeHandle>& edges) {
+		if (!updated_) return;
+		// bulk colors are made for the whole mesh anyway
+		if (bulk_.Active()) {
+			Invalidate();
+			return;
+		}
+		for (const EdgeHandle e : edges) dirty_edges_.push_back(e.idx());
+		// past this point a single full upload is cheaper than many small ones
+		if (dirty_edges_.size() > cmesh().n_edges() / 4) Invalidate();
 	}
 
 	void SetColorFunc(std::function<Color(const EdgeHandle, const unsigned int direction)> f) {
 		edge_color_ = f;
+		bulk_.Clear();
 		Invalidate();
 	}
 
 private:
+	void UpdateEdges() {
+		Bind();
+		const size_t max_gap = 16;
+		bool visibility_changed = false;
+		for (const auto& range : Utils::Ranges(std::move(dirty_edges_), max_gap)) {
+			Eigen::Matrix4Xf line_colors(4, (range.second - range.first) * 2);
+			for (size_t e = range.first; e < range.second; ++e) {
+				const size_t col = 2 * (e - range.first);
+				line_colors.col(col + 0) = edge_color_(EdgeHandle(int(e)), 0);
+				line_colors.col(col + 1) = edge_color_(EdgeHandle(int(e)), 1);
+				const char visible = line_colors(3, col) > 0.0f || line_colors(3, col + 1) > 0.0f;
+				visibility_changed |= visible_[e] != visible;
+				visible_[e] = visible;
+			}
+			UploadColorsRange(line_colors, uint32_t(2 * range.first));
+		}
+		dirty_edges_.clear();
+		if (visibility_changed) UploadVisible();
+	}
+
+	// uploads the lines of the visible edges as indices, if some are hidden
+	void UploadVisible() {
+		n_visible_ = (size_t)std::count(visible_.begin(), visible_.end(), 1);
+		compact_ = n_visible_ < visible_.size();
+		if (!compact_) {
+			FreeAttrib("indices");
+			return;
+		}
+		Eigen::Matrix<uint32_t, 2, Eigen::Dynamic> lines(2, n_visible_);
+		size_t i = 0;
+		for (size_t e = 0; e < visible_.size(); ++e) {
+			if (!visible_[e]) continue;
+			lines(0, i) = uint32_t(2 * e + 0);
+			lines(1, i) = uint32_t(2 * e + 1);
+			++i;
+		}
+		Bind();
+		UploadIndices(lines);
+	}
+
 	std::function<Color(const EdgeHandle, const unsigned int direction)> edge_color_;
+	std::vector<size_t> dirty_edges_;
+	// edges with some color in either end
+	std::vector<char> visible_;
+	size_t n_visible_ = 0;
+	bool compact_ = false;
+	bool compact_draw_ = true;
 };
 
-class HalfedgeShader : public BasicShader {
+class HalfedgeShader : public ElementShader {
 public:
 	HalfedgeShader(const std::string vert,
 		const std::string frag, 
 		const std::string geom)
-		: BasicShader(vert, frag, geom),
+		: ElementShader(vert, frag, geom),
 		halfedge_color_([](const HalfedgeHandle e, const bool opp) { return Color::Empty(); }) {}
 	HalfedgeShader(const std::string vert, 
 		const std::string frag)
@@ -141,20 +346,26 @@ public:
 	void Update() override {
 		if (updated_) return;
 		updated_ = true;
-		size_t i = 0; // line index;
-		Eigen::Matrix4Xf line_colors(4, cmesh().n_halfedges() * 2);
-		for (const HalfedgeHandle he : cmesh().halfedges()) {
-			line_colors.col(i + 0) = halfedge_color_(he, false);
-			line_colors.col(i + 1) = halfedge_color_(he, true);
-			i += 2;
+		Eigen::Matrix4Xf line_colors;
+		if (bulk_.Active()) {
+			bulk_.Get(cmesh().n_halfedges(), 2, line_colors);
+		} else {
+			size_t i = 0; // line index;
+			line_colors.resize(4, cmesh().n_halfedges() * 2);
+			for (const HalfedgeHandle he : cmesh().halfedges()) {
+				line_colors.col(i + 0) = halfedge_color_(he, false);
+				line_colors.col(i + 1) = halfedge_color_(he, true);
+				i += 2;
+			}
+			assert(i == cmesh().n_halfedges() * 2);
 		}
-		assert(i == cmesh().n_halfedges() * 2);
 		Bind();
-		UploadAttrib("vert_color", line_colors);
+		UploadColors(line_colors);
 	}
 
 	void SetColorFunc(const std::function<Color(const HalfedgeHandle e, const bool opp)> f) {
 		halfedge_color_ = f;
+		bulk_.Clear();
 		Invalidate();
 	}
 
@@ -163,6 +374,57 @@ private:
 };
 
 
+// Draws a few elements of buffers shared with another shader, each one with its
+// own colors, without uploading anything. For highlights, which would otherwise 
+// upload and draw colors for the whole mesh to show a couple of elements
+class SparseShader : public BasicShader {
+public:
+	// Vertices [first, first + count) of the shared buffers. Even vertices get
+	// color_even and odd ones color_odd, e.g. the two ends of a line
+	struct Element {
+		uint32_t first;
+		uint32_t count;
+		Color color_even;
+		Color color_odd;
+	};
+
+	SparseShader(const std::string vert,
+		const std::string frag,
+		const std::string geom)
+		: BasicShader(vert, frag, geom),
+		elements_func_([]() { return std::vector<Element>(); }) {}
+	SparseShader(const std::string vert,
+		const std::string frag)
+		: SparseShader(vert, frag, "") {}
+
+	void Update() override {
+		if (updated_) return;
+		updated_ = true;
+		elements_ = elements_func_();
+	}
+
+	void Draw() override {
+		for (const Element& e : elements_) {
+			// the shared buffers may have shrunk since the elements were made
+			if (e.first + e.count > mPrimitiveCount) continue;
+			SetUniform("color_even", glm::vec4(e.color_even.r(), e.color_even.g(), 
+				e.color_even.b(), e.color_even.a()));
+			SetUniform("color_odd", glm::vec4(e.color_odd.r(), e.color_odd.g(), 
+				e.color_odd.b(), e.color_odd.a()));
+			DrawArray(mPrimitiveType, e.first, e.count);
+		}
+	}
+
+	void SetElementsFunc(const std::function<std::vector<Element>()> f) {
+		elements_func_ = f;
+		Invalidate();
+	}
+
+private:
+	std::function<std::vector<Element>()> elements_func_;
+	std::vector<Element> elements_;
+};
+
 class CustomShader : public BasicShader {
 public:
 	CustomShader(const std::string vert,
@@ -178,7 +440,7 @@ public:
 		if (updated_) return;
 		updated_ = true;
 		Bind();
-		UploadAttrib("vert_color", color_func_());
+		UploadColors(color_func_());
 	}
 
 	void SetColorFunc(const std::function<const Eigen::Matrix4Xf()> f) {
@@ -0,0 +1,539 @@
+#include "ObjReader.h"
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <stdint.h>
+
+#include <GLFW\glfw3.h>
+
+#include "MappedFile.h"
+#include "Worker.h"
+#include "Log.h"
+#include "Trace.h"
+
+namespace {
+	// what a chunk of lines contains, indices are 0 based
+	struct Chunk {
+		std::vector<OpenMesh::Vec3f> points; // read as floats like OpenMesh does
+		std::vector<int> face_sizes;
+		std::vector<int> face_vertices; // vertices before every face, a face cannot use later ones
+		std::vector<int> indices;
+		// positions in indices of negative (relative) references, which are
+		// relative to the first vertex of the chunk until the chunks are joined
+		std::vector<size_t> relative;
+	};
+
+	inline bool IsSpace(char c) { return c == ' ' || c == '\t'; }
+	inline bool IsLineEnd(char c) { return c == '\n' || c == '\r'; }
+	inline bool IsDigit(char c) { return (unsigned)(c - '0') < 10; }
+
+	const double powers_of_10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	// Parses a number after optional spaces, without locale or copies. A mantissa
+	// below 2^53 times a power of 10 up to 22 is exact in double, which covers
+	// the numbers written in OBJ files, the others are left to strtod
+	bool ParseDouble(const char*& p, const char* end, double& value) {
+		while (p < end && IsSpace(*p)) ++p;
+		const char* start = p;
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+		uint64_t mantissa = 0;
+		int digits = 0; // significant digits in mantissa
+		int exponent = 0;
+		bool any = false;
+		for (; p < end && IsDigit(*p); ++p) {
+			any = true;
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa > 0) ++digits;
+			} else {
+				++exponent;
+			}
+		}
+		if (p < end && *p == '.') {
+			for (++p; p < end && IsDigit(*p); ++p) {
+				any = true;
+				if (digits < 19) {
+					mantissa = mantissa * 10 + (*p - '0');
+					if (mantissa > 0) ++digits;
+					--exponent;
+				}
+			}
+		}
+		if (any && p < end && (*p == 'e' || *p == 'E')) {
+			const char* e = p + 1;
+			bool negative_exponent = false;
+			if (e < end && (*e == '-' || *e == '+')) negative_exponent = *e++ == '-';
+			if (e < end && IsDigit(*e)) {
+				int value = 0;
+				for (; e < end && IsDigit(*e); ++e) value = std::min(value * 10 + (*e - '0'), 100000);
+				exponent += negative_exponent ? -value : value;
+				p = e;
+			}
+		}
+		if (any && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+			value = exponent >= 0 ? mantissa * powers_of_10[exponent] : mantissa / powers_of_10[-exponent];
+			if (negative) value = -value;
+			return true;
+		}
+
+		// long mantissas, large exponents, inf and nan
+		p = start;
+		while (p < end && !IsSpace(*p) && !IsLineEnd(*p)) ++p;
+		char token[64];
+		const size_t length = std::min<size_t>(p - start, sizeof(token) - 1);
+		if (length == 0) return false;
+		memcpy(token, start, length);
+		token[length] = '\0';
+		char* parsed;
+		value = strtod(token, &parsed);
+		return parsed != token;
+	}
+
+	// OpenMesh reads floats, rounding the same way gives the same points
+	bool ParseFloat(const char*& p, const char* end, float& value) {
+		double parsed;
+		if (!ParseDouble(p, end, parsed)) return false;
+		value = (float)parsed;
+		return true;
+	}
+
+	// the vertex of a "v/vt/vn" face corner, skipping the rest
+	bool ParseIndex(const char*& p, const char* end, int64_t& value) {
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+		bool any = false;
+		value = 0;
+		for (; p < end && IsDigit(*p); ++p) {
+			any = true;
+			value = std::min<int64_t>(value * 10 + (*p - '0'), int64_t(1) << 40);
+		}
+		if (negative) value = -value;
+		while (p < end && !IsSpace(*p) && !IsLineEnd(*p)) ++p;
+		return any;
+	}
+
+	// parses the lines starting in [begin, end), the last one may end after
+	void ParseLines(const char* p, const char* end, const char* file_end, Chunk& chunk) {
+		std::vector<char> face_relative; // for every corner of the face being read
+		while (p < end) {
+			while (p < file_end && IsSpace(*p)) ++p;
+			if (p + 1 < file_end && p[0] == 'v' && IsSpace(p[1])) {
+				p += 2;
+				float x, y, z;
+				if (ParseFloat(p, file_end, x) && ParseFloat(p, file_end, y) && ParseFloat(p, file_end, z)) {
+					chunk.points.push_back(OpenMesh::Vec3f(x, y, z));
+				}
+			} else if (p + 1 < file_end && p[0] == 'f' && IsSpace(p[1])) {
+				p += 2;
+				const size_t face_begin = chunk.indices.size();
+				face_relative.clear();
+				while (true) {
+					while (p < file_end && IsSpace(*p)) ++p;
+					if (p == file_end || IsLineEnd(*p)) break;
+					int64_t index;
+					if (!ParseIndex(p, file_end, index)) continue; // garbage, like OpenMesh
+					const bool relative = index < 0;
+					if (relative) {
+						index += (int64_t)chunk.points.size();
+					} else {
+						--index; // 0 is invalid, and becomes -1
+					}
+					const bool fits = index >= std::numeric_limits<int>::min() && index <= std::numeric_limits<int>::max();
+					const int vertex = fits ? (int)index : -1;
+
+					// OpenMesh keeps the first reference to a vertex in a face. Relative
+					// and absolute ones are only compared with their own kind: the
+					// copies of non-manifold faces can make them differ, and the
+					// importer compares them again with the copies (BuildFaceByFace)
+					bool repeated = false;
+					for (size_t c = face_begin; c < chunk.indices.size() && !repeated; ++c) {
+						repeated = chunk.indices[c] == vertex && face_relative[c - face_begin] == relative;
+					}
+					if (repeated) continue;
+					if (relative) chunk.relative.push_back(chunk.indices.size());
+					chunk.indices.push_back(vertex);
+					face_relative.push_back(relative);
+				}
+				const int size = (int)(chunk.indices.size() - face_begin);
+				if (size < 3) {
+					// like OpenMesh, which skips them after removing the repeated vertices
+					chunk.indices.resize(face_begin);
+					while (!chunk.relative.empty() && chunk.relative.back() >= face_begin) chunk.relative.pop_back();
+				} else {
+					chunk.face_sizes.push_back(size);
+					chunk.face_vertices.push_back((int)chunk.points.size());
+				}
+			}
+			while (p < file_end && *p != '\n') ++p;
+			if (p < file_end) ++p;
+		}
+	}
+
+	// Builds the halfedges of all the faces at once: the corners are grouped
+	// by their lowest vertex to find the two corners of every edge. Returns
+	// false, with the mesh cleared, for faces that add_face would reject or
+	// that are not manifold, which are left to the importer.
+	bool BuildManifold(int n_vertices, const std::vector<int>& face_begin,
+		const std::vector<int>& face_vertices, const std::vector<int>& indices, MyMesh& mesh) {
+		TRACE_FUNCTION();
+		const int nv = n_vertices;
+		const int nf = (int)face_begin.size() - 1;
+		const int nc = (int)indices.size();
+		std::atomic<bool> ok(true);
+
+		std::vector<int> corner_face(nc);
+		Worker::ParallelFor(0, nf, [&](size_t f) {
+			const int begin = face_begin[f], end = face_begin[f + 1];
+			if (end - begin < 3) ok = false;
+			for (int c = begin; c < end; ++c) {
+				if (indices[c] < 0 || indices[c] >= face_vertices[f]) ok = false;
+				// only a relative and an absolute reference can still be the same vertex
+				for (int other = begin; other < c; ++other) {
+					if (indices[other] == indices[c]) ok = false;
+				}
+				corner_face[c] = (int)f;
+			}
+		});
+		if (!ok) return false;
+		auto next_corner = [&](int c) {
+			return c + 1 < face_begin[corner_face[c] + 1] ? c + 1 : face_begin[corner_face[c]];
+		};
+
+		// corners by lowest vertex of their edge, in corner order
+		std::unique_ptr<std::atomic<int>[]> bucket_count(new std::atomic<int>[nv]);
+		std::unique_ptr<std::atomic<int>[]> outgoing(new std::atomic<int>[nv]);
+		std::unique_ptr<std::atomic<int>[]> first_corner(new std::atomic<int>[nv]);
+		std::unique_ptr<std::atomic<int>[]> boundary_out(new std::atomic<int>[nv]);
+		Worker::ParallelFor(0, nv, [&](size_t v) {
+			bucket_count[v] = 0;
+			outgoing[v] = 0;
+			first_corner[v] = nc;
+			boundary_out[v] = -1;
+		});
+		Worker::ParallelFor(0, nc, [&](size_t c) {
+			const int from = indices[c], to = indices[next_corner((int)c)];
+			++bucket_count[std::min(from, to)];
+			++outgoing[from];
+			int first = first_corner[from];
+			while ((int)c < first && !first_corner[from].compare_exchange_weak(first, (int)c)) {}
+		});
+		std::vector<int> bucket_begin;
+		Worker::ParallelPrefixSum(nv, bucket_begin, [&](size_t v) { return (int)bucket_count[v]; });
+		std::vector<int> buckets(nc);
+		Worker::ParallelFor(0, nv, [&](size_t v) { bucket_count[v] = 0; });
+		Worker::ParallelFor(0, nc, [&](size_t c) {
+			const int low = std::min(indices[c], indices[next_corner((int)c)]);
+			buckets[bucket_begin[low] + bucket_count[low]++] = (int)c;
+		});
+
+		// the corners of an edge go in opposite directions, 2 at most. The first
+		// one gets the even halfedge. Sorting by the other vertex puts them side
+		// by side, so a vertex of high valence is not quadratic
+		std::vector<int> corner_halfedge(nc); // in the bucket until offset
+		std::vector<int> edge_count(nv);
+		auto high = [&](int c) { return std::max(indices[c], indices[next_corner(c)]); };
+		Worker::ParallelFor(0, nv, [&](size_t v) {
+			const int begin = bucket_begin[v], end = bucket_begin[v + 1];
+			std::sort(buckets.begin() + begin, buckets.begin() + end, [&](int a, int b) {
+				const int high_a = high(a), high_b = high(b);
+				return high_a != high_b ? high_a < high_b : a < b;
+			});
+			int edges = 0;
+			for (int i = begin; i < end; ++i) {
+				const int c = buckets[i];
+				if (i == begin || high(buckets[i - 1]) != high(c)) {
+					corner_halfedge[c] = 2 * edges++;
+					continue;
+				}
+				const int first = buckets[i - 1];
+				if (i - 1 > begin && high(buckets[i - 2]) == high(c)) ok = false;
+				if (indices[first] == indices[c]) ok = false;
+				corner_halfedge[c] = corner_halfedge[first] + 1;
+			}
+			edge_count[v] = edges;
+		});
+		if (!ok) return false;
+		std::vector<int> edge_begin;
+		Worker::ParallelPrefixSum(nv, edge_begin, [&](size_t v) { return edge_count[v]; });
+		Worker::ParallelFor(0, nc, [&](size_t c) {
+			const int low = std::min(indices[c], indices[next_corner((int)c)]);
+			corner_halfedge[c] += 2 * edge_begin[low];
+		});
+
+		mesh.resize(nv, edge_begin[nv], nf);
+		Worker::ParallelFor(0, nf, [&](size_t f) {
+			const int begin = face_begin[f], end = face_begin[f + 1];
+			for (int c = begin; c < end; ++c) {
+				const HalfedgeHandle he(corner_halfedge[c]);
+				const int next = next_corner(c);
+				mesh.set_vertex_handle(he, VertexHandle(indices[next]));
+				mesh.set_face_handle(he, FaceHandle((int)f));
+				mesh.set_next_halfedge_handle(he, HalfedgeHandle(corner_halfedge[next]));
+			}
+			// same as add_face, so faces start at the same vertex
+			mesh.set_halfedge_handle(FaceHandle((int)f), HalfedgeHandle(corner_halfedge[end - 1]));
+		});
+
+		// the halfedges without a corner are on the boundary. A vertex with two
+		// boundaries is not manifold
+		std::vector<char> boundary_corner(nc, 0);
+		Worker::ParallelFor(0, nc, [&](size_t c) {
+			const HalfedgeHandle opposite(corner_halfedge[c] ^ 1);
+			if (mesh.to_vertex_handle(opposite).is_valid()) return;
+			boundary_corner[c] = 1;
+			mesh.set_vertex_handle(opposite, VertexHandle(indices[c]));
+			int none = -1;
+			if (!boundary_out[indices[next_corner((int)c)]].compare_exchange_strong(none, opposite.idx())) ok = false;
+		});
+		if (!ok) {
+			mesh.clear();
+			return false;
+		}
+		Worker::ParallelFor(0, nc, [&](size_t c) {
+			if (!boundary_corner[c]) return;
+			const HalfedgeHandle opposite(corner_halfedge[c] ^ 1);
+			const int next = boundary_out[indices[c]];
+			if (next < 0) {
+				ok = false;
+				return;
+			}
+			mesh.set_next_halfedge_handle(opposite, HalfedgeHandle(next));
+		});
+		if (!ok) {
+			mesh.clear();
+			return false;
+		}
+
+		// boundary vertices start at their boundary halfedge. Going around every
+		// vertex must reach all its halfedges, otherwise it joins separate fans
+		Worker::ParallelFor(0, nv, [&](size_t i) {
+			const VertexHandle v((int)i);
+			const int out = boundary_out[i];
+			const int first = first_corner[i];
+			if (out < 0 && first == nc) return; // isolated
+			const HalfedgeHandle start(out >= 0 ? out : corner_halfedge[first]);
+			mesh.set_halfedge_handle(v, start);
+			const int expected = outgoing[i] + (out >= 0 ? 1 : 0);
+			int steps = 0;
+			HalfedgeHandle he = start;
+			do {
+				he = mesh.next_halfedge_handle(mesh.opposite_halfedge_handle(he));
+			} while (++steps <= expected && he != start);
+			if (steps != expected) ok = false;
+		});
+		if (!ok) {
+			mesh.clear();
+			return false;
+		}
+		return true;
+	}
+
+	// Same as OpenMesh's reader: repeated vertices are removed from the faces,
+	// faces with invalid vertices or less than 3 are skipped, and faces
+	// add_face rejects get their own copy of their vertices,
+	// marked as non-manifold. The copies come between the vertices of the file
+	// and count for relative indices like there. Its importer asserts on those
+	// faces in debug builds, so it is not used
+	void BuildFaceByFace(const std::vector<Vec3d>& points, const std::vector<int>& face_begin,
+		const std::vector<int>& face_vertices, const std::vector<int>& indices,
+		const std::vector<size_t>& relative, MyMesh& mesh) {
+		TRACE_FUNCTION();
+		mesh.clear();
+		size_t n_added = 0;
+		int copies = 0;
+		auto next_relative = relative.begin();
+		std::vector<VertexHandle> face;
+		for (size_t f = 0; f + 1 < face_begin.size(); ++f) {
+			for (; n_added < (size_t)face_vertices[f]; ++n_added) mesh.add_vertex(points[n_added]);
+			face.clear();
+			bool valid = true;
+			for (int c = face_begin[f]; c < face_begin[f + 1]; ++c) {
+				int index = indices[c];
+				if (next_relative != relative.end() && *next_relative == (size_t)c) {
+					index += copies;
+					++next_relative;
+				}
+				const VertexHandle v(index);
+				if (!mesh.is_valid_handle(v)) valid = false;
+				if (std::find(face.begin(), face.end(), v) == face.end()) face.push_back(v);
+			}
+			if (!valid || face.size() < 3) continue;
+			if (mesh.add_face(face).is_valid()) continue;
+			for (VertexHandle& v : face) {
+				const Vec3d point = mesh.point(v);
+				v = mesh.add_vertex(point);
+				mesh.status(v).set_fixed_nonmanifold(true);
+			}
+			copies += (int)face.size();
+			const FaceHandle added = mesh.add_face(face);
+			mesh.status(added).set_fixed_nonmanifold(true);
+			for (const EdgeHandle e : mesh.fe_range(added)) mesh.status(e).set_fixed_nonmanifold(true);
+		}
+		for (; n_added < points.size(); ++n_added) mesh.add_vertex(points[n_added]);
+	}
+
+	// both meshes have the same elements in the same order, edges may be in another order
+	bool SameMesh(const MyMesh& a, const MyMesh& b, std::string& difference) {
+		if (a.n_vertices() != b.n_vertices() || a.n_faces() != b.n_faces() || a.n_edges() != b.n_edges()) {
+			difference = "element counts";
+			return false;
+		}
+		for (const VertexHandle v : a.vertices()) {
+			if (a.point(v) != b.point(v)) {
+				difference = "points";
+				return false;
+			}
+			if (a.is_boundary(v) != b.is_boundary(v) || a.valence(v) != b.valence(v)) {
+				difference = "vertex neighborhoods";
+				return false;
+			}
+		}
+		std::vector<VertexHandle> face_a, face_b;
+		for (const FaceHandle f : a.faces()) {
+			face_a.assign(a.cfv_begin(f), a.cfv_end(f));
+			face_b.assign(b.cfv_begin(f), b.cfv_end(f));
+			if (face_a != face_b) {
+				difference = "faces";
+				return false;
+			}
+		}
+		auto edge_keys = [](const MyMesh& mesh) {
+			std::vector<uint64_t> keys;
+			keys.reserve(mesh.n_edges());
+			for (const EdgeHandle e : mesh.edges()) {
+				const HalfedgeHandle he = mesh.halfedge_handle(e, 0);
+				const uint64_t from = mesh.from_vertex_handle(he).idx(), to = mesh.to_vertex_handle(he).idx();
+				keys.push_back(std::min(from, to) << 32 | std::max(from, to));
+			}
+			std::sort(keys.begin(), keys.end());
+			return keys;
+		};
+		if (edge_keys(a) != edge_keys(b)) {
+			difference = "edges";
+			return false;
+		}
+		return true;
+	}
+}
+
+bool ObjReader::IsObj(const std::string& filename) {
+	if (filename.size() < 4) return false;
+	std::string extension = filename.substr(filename.size() - 4);
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension == ".obj";
+}
+
+bool ObjReader::Read(const std::string& filename, MyMesh& mesh) {
+	TRACE_FUNCTION();
+	MappedFile file;
+	if (!file.Open(filename)) return false;
+	const char* data = file.Data();
+	const size_t size = file.Size();
+
+	// chunks start at the first line starting in their range
+	std::vector<Chunk> chunks(Worker::ChunkCount(size));
+	{
+		TRACE_SCOPE("Parse lines");
+		Worker::ParallelChunks(0, size, chunks.size(), [&](size_t chunk, size_t begin, size_t end) {
+			const char* p = data + begin;
+			if (begin > 0 && p[-1] != '\n') {
+				while (p < data + end && *p != '\n') ++p;
+				if (p < data + end) ++p;
+			}
+			ParseLines(p, data + end, data + size, chunks[chunk]);
+		});
+	}
+	Worker::SetProgress(0.3f);
+	if (Worker::Cancelled()) return false;
+
+	// join the chunks
+	std::vector<size_t> vertex_offset(chunks.size() + 1, 0), face_offset(chunks.size() + 1, 0),
+		index_offset(chunks.size() + 1, 0);
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		vertex_offset[i + 1] = vertex_offset[i] + chunks[i].points.size();
+		face_offset[i + 1] = face_offset[i] + chunks[i].face_sizes.size();
+		index_offset[i + 1] = index_offset[i] + chunks[i].indices.size();
+	}
+	// handles are ints, and every corner is a halfedge
+	if (index_offset.back() > (size_t)std::numeric_limits<int>::max() / 2
+		|| vertex_offset.back() > (size_t)std::numeric_limits<int>::max()) {
+		print(LogLevel::Error, "%s is too large\n", filename.c_str());
+		return false;
+	}
+	std::vector<Vec3d> points(vertex_offset.back());
+	std::vector<int> face_begin(face_offset.back() + 1);
+	std::vector<int> face_vertices(face_offset.back());
+	std::vector<int> indices(index_offset.back());
+	face_begin.back() = (int)indices.size();
+	Worker::ParallelFor(0, chunks.size(), [&](size_t i) {
+		Chunk& chunk = chunks[i];
+		for (size_t v = 0; v < chunk.points.size(); ++v) {
+			points[vertex_offset[i] + v] = OpenMesh::vector_cast<Vec3d>(chunk.points[v]);
+		}
+		for (size_t& position : chunk.relative) {
+			chunk.indices[position] += (int)vertex_offset[i];
+			position += index_offset[i];
+		}
+		std::copy(chunk.indices.begin(), chunk.indices.end(), indices.begin() + index_offset[i]);
+		int begin = (int)index_offset[i];
+		for (size_t f = 0; f < chunk.face_sizes.size(); ++f) {
+			face_begin[face_offset[i] + f] = begin;
+			face_vertices[face_offset[i] + f] = chunk.face_vertices[f] + (int)vertex_offset[i];
+			begin += chunk.face_sizes[f];
+		}
+		// free them early, only the relative references may be needed again
+		std::vector<OpenMesh::Vec3f>().swap(chunk.points);
+		std::vector<int>().swap(chunk.face_sizes);
+		std::vector<int>().swap(chunk.face_vertices);
+		std::vector<int>().swap(chunk.indices);
+	});
+	Worker::SetProgress(0.4f);
+	if (Worker::Cancelled()) return false;
+
+	mesh.clear();
+	if (BuildManifold((int)points.size(), face_begin, face_vertices, indices, mesh)) {
+		mesh.property(mesh.points_pph()).data_vector().swap(points);
+	} else {
+		print("Mesh is not manifold, adding its faces one by one\n");
+		std::vector<size_t> relative;
+		for (const Chunk& chunk : chunks) relative.insert(relative.end(), chunk.relative.begin(), chunk.relative.end());
+		BuildFaceByFace(points, face_begin, face_vertices, indices, relative, mesh);
+	}
+	Worker::SetProgress(0.6f);
+	return !Worker::Cancelled();
+}
+
+void ObjReader::CompareWithOpenMesh(const std::string& filename) {
+	print("Comparing the OBJ readers on %s\n", filename.c_str());
+	MyMesh fast, reference;
+	double start = glfwGetTime();
+	if (!Read(filename, fast)) {
+		print(LogLevel::Error, "Could not read %s\n", filename.c_str());
+		return;
+	}
+	const double fast_time = glfwGetTime() - start;
+	start = glfwGetTime();
+	OpenMesh::IO::Options opt;
+	if (!OpenMesh::IO::read_mesh(reference, filename, opt)) {
+		print(LogLevel::Error, "OpenMesh could not read %s\n", filename.c_str());
+		return;
+	}
+	const double reference_time = glfwGetTime() - start;
+	print("Fast reader %.3f s, OpenMesh %.3f s (%.1fx), %d vertices, %d faces\n", fast_time,
+		reference_time, reference_time / std::max(fast_time, 1e-9), (int)fast.n_vertices(), (int)fast.n_faces());
+	std::string difference;
+	if (SameMesh(fast, reference, difference)) {
+		print("The meshes are the same\n");
+	} else {
+		print(LogLevel::Error, "The meshes differ: %s\n", difference.c_str());
+	}
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+
+#include "MyMesh.h"
+
+// Reader of Wavefront OBJ files for large meshes. The file is memory mapped
+// and its lines are parsed on all cores, then the connectivity is built in
+// bulk instead of face by face. Only vertices and faces are read, normals,
+// texture coordinates and materials are ignored. The mesh is the same as the
+// one of OpenMesh's reader, including points rounded to float like it does
+class ObjReader {
+public:
+	static bool IsObj(const std::string& filename);
+
+	// Fills the empty mesh. Faces that are not manifold or not consistently
+	// oriented make it add the faces one by one like OpenMesh does, which is
+	// slower. Returns false if the file cannot be read or the running task was cancelled
+	static bool Read(const std::string& filename, MyMesh& mesh);
+
+	// Reads the file with this reader and OpenMesh's, prints both times and
+	// whether the meshes are the same
+	static void CompareWithOpenMesh(const std::string& filename);
+};
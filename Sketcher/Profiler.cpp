@@ -0,0 +1,279 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <cmath>
+#include <cfloat>
+#include <stdio.h>
+
+#include <GLFW\glfw3.h>
+#include <imgui.h>
+
+#include "Worker.h"
+#include "Log.h"
+#include "FileDialog.h"
+
+namespace {
+	// bins of the distribution histograms
+	const int histogram_bins = 40;
+
+	// nearest rank percentile, p in [0, 1]
+	float Percentile(std::vector<float> values, float p) {
+		if (values.empty()) return 0.0f;
+		const size_t rank = (size_t)std::ceil(p * values.size());
+		const size_t index = std::min(values.size() - 1, rank > 0 ? rank - 1 : 0);
+		std::nth_element(values.begin(), values.begin() + index, values.end());
+		return values[index];
+	}
+}
+
+Profiler& Profiler::Instance() {
+	static Profiler instance;
+	return instance;
+}
+
+int Profiler::Section(const std::string& name) {
+	for (size_t i = 0; i < sections_.size(); ++i) {
+		if (sections_[i].name == name) return (int)i;
+	}
+	sections_.push_back(SectionData());
+	sections_.back().name = name;
+	return (int)sections_.size() - 1;
+}
+
+void Profiler::Samples::Push(uint64_t frame, float ms) {
+	const Sample sample = { frame, ms };
+	if (ring.size() < history) {
+		ring.push_back(sample);
+	} else {
+		ring[count % history] = sample;
+	}
+	++count;
+}
+
+size_t Profiler::Samples::Size() const {
+	return ring.size();
+}
+
+void Profiler::Samples::Values(std::vector<float>& values) const {
+	values.resize(ring.size());
+	// the oldest sample is the next to be overwritten
+	const size_t first = ring.size() < history ? 0 : count % history;
+	for (size_t i = 0; i < ring.size(); ++i) {
+		values[i] = ring[(first + i) % ring.size()].ms;
+	}
+}
+
+void Profiler::BeginFrame() {
+	CollectQueries();
+	if (!enabled) return;
+	if (frame_section_ < 0) frame_section_ = Section("Frame");
+	++frame_;
+	in_frame_ = true;
+	frame_start_ = glfwGetTime();
+	current_.frame = frame_;
+	current_.queries.clear();
+}
+
+void Profiler::EndFrame() {
+	if (!in_frame_) return;
+	AddCpu(frame_section_, (glfwGetTime() - frame_start_) * 1000);
+	in_frame_ = false;
+	for (SectionData& section : sections_) {
+		if (!section.timed) continue;
+		section.cpu.Push(frame_, (float)section.frame_cpu);
+		section.frame_cpu = 0.0;
+		section.timed = false;
+	}
+	if (!current_.queries.empty()) {
+		pending_.push_back(current_);
+	}
+}
+
+void Profiler::AddCpu(int section, double ms) {
+	if (!in_frame_) return;
+	sections_[section].frame_cpu += ms;
+	sections_[section].timed = true;
+}
+
+bool Profiler::BeginGpu(int section) {
+	if (!in_frame_ || gpu_active_) return false;
+	GLuint query;
+	if (free_queries_.empty()) {
+		glGenQueries(1, &query);
+	} else {
+		query = free_queries_.back();
+		free_queries_.pop_back();
+	}
+	glBeginQuery(GL_TIME_ELAPSED, query);
+	current_.queries.push_back(std::make_pair(section, query));
+	gpu_active_ = true;
+	return true;
+}
+
+void Profiler::EndGpu() {
+	glEndQuery(GL_TIME_ELAPSED);
+	gpu_active_ = false;
+}
+
+void Profiler::CollectQueries() {
+	std::vector<double> frame_gpu;
+	while (!pending_.empty()) {
+		PendingFrame& pending = pending_.front();
+		for (const auto& query : pending.queries) {
+			GLint available = 0;
+			glGetQueryObjectiv(query.second, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) return; // later frames are not done either
+		}
+
+		frame_gpu.assign(sections_.size(), -1.0);
+		for (const auto& query : pending.queries) {
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(query.second, GL_QUERY_RESULT, &ns);
+			double& ms = frame_gpu[query.first];
+			ms = std::max(ms, 0.0) + ns * 1e-6;
+			free_queries_.push_back(query.second);
+		}
+		for (size_t i = 0; i < sections_.size(); ++i) {
+			if (frame_gpu[i] >= 0.0) sections_[i].gpu.Push(pending.frame, (float)frame_gpu[i]);
+		}
+		pending_.pop_front();
+	}
+}
+
+Profiler::CpuScope::CpuScope(int section)
+	: section_(Instance().in_frame_ ? section : -1), start_(0.0) {
+	if (section_ >= 0) start_ = glfwGetTime();
+}
+
+Profiler::CpuScope::~CpuScope() {
+	if (section_ >= 0) Instance().AddCpu(section_, (glfwGetTime() - start_) * 1000);
+}
+
+Profiler::GpuScope::GpuScope(int section)
+	: active_(Instance().BeginGpu(section)) {}
+
+Profiler::GpuScope::~GpuScope() {
+	if (active_) Instance().EndGpu();
+}
+
+void Profiler::Clear() {
+	for (SectionData& section : sections_) {
+		section.cpu = Samples();
+		section.gpu = Samples();
+	}
+}
+
+void Profiler::Terminate() {
+	for (const PendingFrame& pending : pending_) {
+		for (const auto& query : pending.queries) free_queries_.push_back(query.second);
+	}
+	pending_.clear();
+	if (!free_queries_.empty()) {
+		glDeleteQueries((GLsizei)free_queries_.size(), free_queries_.data());
+	}
+	free_queries_.clear();
+}
+
+bool Profiler::ExportCSV(const std::string& filename) const {
+	return WriteCSV(sections_, filename);
+}
+
+bool Profiler::WriteCSV(const std::vector<SectionData>& sections, const std::string& filename) {
+	std::ofstream file(filename);
+	if (!file) return false;
+	file << "section,clock,frame,ms\n";
+	for (const SectionData& section : sections) {
+		for (const Sample& sample : section.cpu.ring) {
+			file << section.name << ",cpu," << sample.frame << "," << sample.ms << "\n";
+		}
+		for (const Sample& sample : section.gpu.ring) {
+			file << section.name << ",gpu," << sample.frame << "," << sample.ms << "\n";
+		}
+	}
+	return (bool)file;
+}
+
+void Profiler::Draw(const char* title, bool* p_open) {
+	ImGui::SetNextWindowSize(ImVec2(520, 560), ImGuiSetCond_FirstUseEver);
+	ImGui::Begin(title, p_open);
+	ImGui::Checkbox("Enabled", &enabled);
+	ImGui::SameLine();
+	if (ImGui::Button("Clear")) Clear();
+	ImGui::SameLine();
+	if (ImGui::Button("Export CSV")) {
+		// the dialog blocks, so the samples are copied and written by a task
+		auto sections = std::make_shared<std::vector<SectionData>>(sections_);
+		Worker::Do([sections]() {
+			std::string name = file_dialog({ { "csv", "csv" } }, true);
+			if (name.empty()) return;
+			if (name.size() < 4 || name.substr(name.size() - 4) != ".csv") name += ".csv";
+			if (WriteCSV(*sections, name)) {
+				print("Saved frame times to %s\n", name.c_str());
+			} else {
+				print(LogLevel::Error, "Could not write %s\n", name.c_str());
+			}
+		}, Priority::High, "Export frame times");
+	}
+	ImGui::Separator();
+
+	// p50 and p99 of every section, in ms
+	ImGui::Columns(5, "profiler sections");
+	ImGui::Text("Section"); ImGui::NextColumn();
+	ImGui::Text("CPU p50"); ImGui::NextColumn();
+	ImGui::Text("CPU p99"); ImGui::NextColumn();
+	ImGui::Text("GPU p50"); ImGui::NextColumn();
+	ImGui::Text("GPU p99"); ImGui::NextColumn();
+	ImGui::Separator();
+	std::vector<float> values;
+	for (size_t i = 0; i < sections_.size(); ++i) {
+		const SectionData& section = sections_[i];
+		if (ImGui::Selectable(section.name.c_str(), selected_ == (int)i,
+			ImGuiSelectableFlags_SpanAllColumns)) {
+			selected_ = (int)i;
+		}
+		ImGui::NextColumn();
+		for (const Samples* samples : { &section.cpu, &section.gpu }) {
+			if (samples->Size() == 0) {
+				ImGui::TextDisabled("-"); ImGui::NextColumn();
+				ImGui::TextDisabled("-"); ImGui::NextColumn();
+				continue;
+			}
+			samples->Values(values);
+			ImGui::Text("%.3f", Percentile(values, 0.5f)); ImGui::NextColumn();
+			ImGui::Text("%.3f", Percentile(values, 0.99f)); ImGui::NextColumn();
+		}
+	}
+	ImGui::Columns(1);
+	ImGui::Separator();
+
+	// distribution and history of the selected section
+	if (selected_ < (int)sections_.size()) {
+		const SectionData& section = sections_[selected_];
+		ImGui::Text("%s, last %d frames", section.name.c_str(), (int)history);
+		const std::pair<const Samples*, const char*> clocks[] = {
+			{ &section.cpu, "CPU" }, { &section.gpu, "GPU" } };
+		for (const auto& clock : clocks) {
+			if (clock.first->Size() == 0) continue;
+			clock.first->Values(values);
+			const float max = *std::max_element(values.begin(), values.end());
+			std::vector<float> bins(histogram_bins, 0.0f);
+			for (const float ms : values) {
+				const int bin = max > 0.0f ? (int)(ms / max * (histogram_bins - 1)) : 0;
+				bins[bin] += 1.0f;
+			}
+			char overlay[64];
+			snprintf(overlay, sizeof(overlay), "p50 %.3f ms, p99 %.3f ms, max %.3f ms",
+				Percentile(values, 0.5f), Percentile(values, 0.99f), max);
+			ImGui::PushID(clock.second);
+			ImGui::Text("%s, 0 to %.3f ms", clock.second, max);
+			ImGui::PlotHistogram("##distribution", bins.data(), histogram_bins, 0, overlay,
+				0.0f, FLT_MAX, ImVec2(0, 80));
+			ImGui::PlotLines("##history", values.data(), (int)values.size(), 0, nullptr,
+				0.0f, FLT_MAX, ImVec2(0, 60));
+			ImGui::PopID();
+		}
+	}
+	ImGui::End();
+}
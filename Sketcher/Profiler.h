@@ -0,0 +1,115 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdint.h>
+
+#include <GL\gl3w.h>
+
+// Per-frame timings of named sections: CPU time, and GPU time with timer
+// queries. The last frames of every section are kept for the Profiler
+// window, which shows their distribution and p50/p99, and exports them to CSV.
+// Only used from the render thread.
+class Profiler {
+public:
+	static Profiler& Instance();
+
+	// Index of the section with that name, created if needed. Look it up once
+	// and keep the index, scopes take it instead of the name
+	int Section(const std::string& name);
+
+	// Frame boundaries, the time between them is the "Frame" section. Times of a
+	// section timed many times in a frame are added. GPU times show up a few
+	// frames later, when their queries are done
+	void BeginFrame();
+	void EndFrame();
+
+	// Adds the CPU time of the section to the current frame
+	class CpuScope {
+	public:
+		CpuScope(int section);
+		~CpuScope();
+	private:
+		int section_;
+		double start_;
+	};
+
+	// Measures the GL commands issued during its lifetime. GL timer queries
+	// cannot nest, a scope inside another one is ignored
+	class GpuScope {
+	public:
+		GpuScope(int section);
+		~GpuScope();
+	private:
+		bool active_;
+	};
+
+	void Draw(const char* title, bool* p_open);
+
+	// writes every kept sample as section,clock,frame,ms
+	bool ExportCSV(const std::string& filename) const;
+
+	void Clear();
+	// frees the GL queries, before the context is destroyed
+	void Terminate();
+
+	bool enabled = true;
+
+	// frames kept per section
+	enum { history = 256 };
+
+private:
+	Profiler() {}
+	~Profiler() {}
+
+	struct Sample {
+		uint64_t frame;
+		float ms;
+	};
+
+	// last samples, a ring of size history
+	struct Samples {
+		std::vector<Sample> ring;
+		size_t count = 0; // ever pushed
+
+		void Push(uint64_t frame, float ms);
+		size_t Size() const;
+		// in push order
+		void Values(std::vector<float>& values) const;
+	};
+
+	struct SectionData {
+		std::string name;
+		Samples cpu;
+		Samples gpu;
+		double frame_cpu = 0.0; // ms this frame
+		bool timed = false;
+	};
+
+	// timer queries of a frame, read once all of them are done
+	struct PendingFrame {
+		uint64_t frame;
+		std::vector<std::pair<int, GLuint>> queries; // section, query
+	};
+
+	void AddCpu(int section, double ms);
+	bool BeginGpu(int section);
+	void EndGpu();
+	// reads the frames whose queries are done, oldest first
+	void CollectQueries();
+	static bool WriteCSV(const std::vector<SectionData>& sections, const std::string& filename);
+
+	std::vector<SectionData> sections_;
+	uint64_t frame_ = 0;
+	bool in_frame_ = false;
+	double frame_start_ = 0.0;
+	int frame_section_ = -1;
+	bool gpu_active_ = false;
+	std::deque<PendingFrame> pending_;
+	PendingFrame current_;
+	std::vector<GLuint> free_queries_;
+
+	// section shown in the histograms
+	int selected_ = 0;
+};
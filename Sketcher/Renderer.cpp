@@ -1,6 +1,9 @@
 #include "Renderer.h"
 
 #include <iostream>
+#include <limits>
+#include <algorithm>
+#include <cmath>
 #include <assert.h>
 
 #include <imgui.h>
@@ -9,8 +12,15 @@
 #include "Log.h"
 #include "FileDialog.h"
 #include "Converters.h"
+#include "Utils.h"
+#include "BVH.h"
+#include "Profiler.h"
+#include "Trace.h"
 
 namespace {
+	// uniform buffer binding point of FrameData
+	const GLuint frame_data_binding = 0;
+
 	Vec3d halfedge_normal(const HalfedgeHandle he) {
 		const FaceHandle f1 = cmesh().face_handle(he);
 		const HalfedgeHandle opp = cmesh().opposite_halfedge_handle(he);
@@ -33,81 +43,167 @@ namespace {
 		}
 	}
 
-	double RayEdgeDist(const Vec3d &rayBase, const Vec3d &rayDirection, const EdgeHandle edge) {
-		HalfedgeHandle he = cmesh().halfedge_handle(edge, 0);
-		Vec3d start = cmesh().point(cmesh().from_vertex_handle(he));
-		Vec3d end = cmesh().point(cmesh().to_vertex_handle(he));
-
-		Vec3d segDirection = end - start;
-		Vec3d u = rayBase - start;
-		double a = OpenMesh::dot(rayDirection, rayDirection);
-		double b = OpenMesh::dot(rayDirection, segDirection);
-		double c = OpenMesh::dot(segDirection, segDirection);
-		double d = OpenMesh::dot(rayDirection, u);
-		double e = OpenMesh::dot(segDirection, u);
+	// distance from p to the segment [a, b]
+	double PointSegmentDist(const Vec3d& p, const Vec3d& a, const Vec3d& b) {
+		const Vec3d ab = b - a;
+		const double length2 = OpenMesh::dot(ab, ab);
+		double t = length2 > 0.0 ? OpenMesh::dot(p - a, ab) / length2 : 0.0;
+		t = std::min(1.0, std::max(0.0, t));
+		return (a + ab * t - p).norm();
+	}
 
-		double sNum;
-		double tNum;
-		double sDenom;
-		double tDenom;
+	// ==== Buffer writers ====
+	// Each one writes the columns of a single element, so a buffer can be 
+	// filled in any order, in parallel, or only for the elements that changed
+	using Converters::d2f;
 
-		double det = a * c - b * b;
+	// triangle fan of f, 3 columns per triangle starting at col
+	void WriteFaceTriangles(const FaceHandle f, size_t col,
+		Eigen::Matrix3Xf& positions, Eigen::Matrix3Xf* normals) {
+		MyMesh::ConstFaceVertexCCWIter it = cmesh().cfv_ccwbegin(f);
+		const VertexHandle first = *it;
+		++it;
+		const size_t face_triangles = cmesh().valence(f) - 2;
+		for (size_t j = 0; j < face_triangles; ++j) {
+			const VertexHandle second = *it;
+			++it;
+			positions.col(col + 0) = d2f(cmesh().point(first));
+			positions.col(col + 1) = d2f(cmesh().point(second));
+			positions.col(col + 2) = d2f(cmesh().point(*it));
+			if (normals) {
+				normals->col(col + 0) = d2f(cmesh().good_normal(first, f));
+				normals->col(col + 1) = d2f(cmesh().good_normal(second, f));
+				normals->col(col + 2) = d2f(cmesh().good_normal(*it, f));
+			}
+			col += 3;
+		}
+	}
 
-		if (det < EPSILON) {
-			sNum = 0;
-			tNum = e;
-			tDenom = c;
-			sDenom = det;
-		} else {
-			sNum = b * e - c * d;
-			tNum = a * e - b * d;
+	// same triangle fan as WriteFaceTriangles, 1 column per triangle. 
+	// corner[he] is the vertex used by face(he) for to_vertex(he)
+	void WriteFaceIndices(const FaceHandle f, size_t col, const std::vector<uint32_t>& corner,
+		Eigen::Matrix<uint32_t, 3, Eigen::Dynamic>& indices) {
+		MyMesh::ConstFaceHalfedgeCCWIter it = cmesh().cfh_ccwbegin(f);
+		const uint32_t first = corner[it->idx()];
+		++it;
+		const size_t face_triangles = cmesh().valence(f) - 2;
+		for (size_t j = 0; j < face_triangles; ++j) {
+			indices(0, col) = first;
+			indices(1, col) = corner[it->idx()];
+			++it;
+			indices(2, col) = corner[it->idx()];
+			++col;
 		}
+	}
 
-		// check s
+	// 2 columns per element from here on
+	void WriteEdge(const EdgeHandle e, const size_t col, 
+		Eigen::Matrix3Xf& positions, Eigen::Matrix3Xf& normals) {
+		const HalfedgeHandle he = cmesh().halfedge_handle(e, 0);
+		positions.col(col + 0) = d2f(cmesh().point(cmesh().from_vertex_handle(he)));
+		positions.col(col + 1) = d2f(cmesh().point(cmesh().to_vertex_handle(he)));
+		normals.col(col + 0) = d2f(cmesh().normal(e));
+		normals.col(col + 1) = d2f(cmesh().normal(e));
+	}
 
-		sDenom = det;
-		if (sNum < 0) {
-			sNum = 0;
-			tNum = e;
-			tDenom = c;
-		} else {
-			tDenom = det;
-		}
-		if (tNum < 0) {
-			tNum = 0;
-			if (-d < 0) {
-				sNum = 0;
-			} else {
-				sNum = -d;
-				sDenom = a;
-			}
-		} else if (tNum > tDenom) {
-			tNum = tDenom;
-			if ((-d + b) < 0) {
-				sNum = 0;
-			} else {
-				sNum = -d + b;
-				sDenom = a;
+	void WriteVertexNormalLine(const VertexHandle v, const size_t col, 
+		const double length, Eigen::Matrix3Xf& positions) {
+		positions.col(col + 0) = d2f(cmesh().point(v));
+		positions.col(col + 1) = d2f(cmesh().point(v) + cmesh().normal(v) * length);
+	}
+
+	void WriteHalfedgeNormalLine(const HalfedgeHandle he, const size_t col, 
+		const double length, Eigen::Matrix3Xf& positions) {
+		const Vec3d from = cmesh().midpoint(he);
+		positions.col(col + 0) = d2f(from);
+		positions.col(col + 1) = d2f(from + halfedge_normal(he) * length);
+	}
+
+	void WriteFaceNormalLine(const FaceHandle f, const size_t col, 
+		const double length, Eigen::Matrix3Xf& positions) {
+		const Vec3d from = cmesh().midpoint(f);
+		positions.col(col + 0) = d2f(from);
+		positions.col(col + 1) = d2f(from + cmesh().normal(f) * length);
+	}
+
+	// ==== Compact vertex formats ====
+	typedef Eigen::Matrix<uint16_t, 3, Eigen::Dynamic> QuantizedPositions;
+	typedef Eigen::Matrix<uint16_t, 2, Eigen::Dynamic> OctahedralNormals;
+
+	// positions in the box [offset, offset + scale] to normalized 16-bit integers. 
+	// Returns the largest error, or infinity if a position is outside the box
+	float QuantizePositions(const Eigen::Matrix3Xf& positions, const Vector3f& offset,
+		const Vector3f& scale, QuantizedPositions& quantized) {
+		quantized.resize(3, positions.cols());
+		return Worker::ParallelReduce(0, (size_t)positions.cols(), 0.0f, [&](size_t i) {
+			float error = 0.0f;
+			for (int axis = 0; axis < 3; ++axis) {
+				const float t = (positions(axis, i) - offset[axis]) / scale[axis];
+				if (!(t >= -1e-6f && t <= 1.0f + 1e-6f)) return std::numeric_limits<float>::infinity();
+				const uint16_t q = uint16_t(std::min(std::max(t, 0.0f), 1.0f) * 65535.0f + 0.5f);
+				quantized(axis, i) = q;
+				const float decoded = offset[axis] + scale[axis] * (q / 65535.0f);
+				error = std::max(error, std::abs(decoded - positions(axis, i)));
 			}
+			return error;
+		}, [](float a, float b) { return std::max(a, b); });
+	}
+
+	float Sign(float x) { return x >= 0.0f ? 1.0f : -1.0f; }
+
+	Vector3f DecodeOctahedral(float x, float y) {
+		Vector3f v(x, y, 1.0f - std::abs(x) - std::abs(y));
+		if (v.z() < 0.0f) {
+			v.x() = (1.0f - std::abs(y)) * Sign(x);
+			v.y() = (1.0f - std::abs(x)) * Sign(y);
 		}
+		return v.normalized();
+	}
 
-		double s = sNum / sDenom;
-		double t = tNum / tDenom;
-		Vec3d v = (rayBase + s * rayDirection) - (start + t * segDirection);
-		return OpenMesh::dot(v, v);
+	// unit normals to octahedral coordinates in [0, 1] as normalized 16-bit integers.
+	// Returns the largest angle between a normal and its decoded one, in radians
+	float EncodeOctahedral(const Eigen::Matrix3Xf& normals, OctahedralNormals& encoded) {
+		encoded.resize(2, normals.cols());
+		return Worker::ParallelReduce(0, (size_t)normals.cols(), 0.0f, [&](size_t i) {
+			const Vector3f n = normals.col(i);
+			const float l1 = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+			if (l1 == 0.0f) {
+				encoded.col(i).setConstant(32768); // degenerate normal, decodes to +z
+				return 0.0f;
+			}
+			Eigen::Vector2f e(n.x() / l1, n.y() / l1);
+			if (n.z() < 0.0f) {
+				e = Eigen::Vector2f((1.0f - std::abs(e.y())) * Sign(e.x()), (1.0f - std::abs(e.x())) * Sign(e.y()));
+			}
+			for (int k = 0; k < 2; ++k) {
+				const float t = std::min(std::max(e[k] * 0.5f + 0.5f, 0.0f), 1.0f);
+				encoded(k, i) = uint16_t(t * 65535.0f + 0.5f);
+			}
+			const Vector3f decoded = DecodeOctahedral(
+				encoded(0, i) / 65535.0f * 2.0f - 1.0f, encoded(1, i) / 65535.0f * 2.0f - 1.0f);
+			// acos is too imprecise for angles this small
+			const Vector3f unit = n.normalized();
+			return std::atan2(decoded.cross(unit).norm(), decoded.dot(unit));
+		}, [](float a, float b) { return std::max(a, b); });
 	}
 
-	double RayVertexDist(const Vec3d &rayBase, const Vec3d &rayDirection, const VertexHandle vert) {
-		Vec3d p = cmesh().point(vert);
-		Vec3d w = (p - rayBase);
-		Vec3d c = OpenMesh::cross(rayDirection, w);
-		return c.norm();
+	// indices of the set flags, in order
+	std::vector<size_t> FlagIndices(const std::vector<char>& flags) {
+		std::vector<size_t> offsets;
+		Worker::ParallelPrefixSum(flags.size(), offsets, 
+			[&flags](size_t i) { return size_t(flags[i] != 0); });
+		std::vector<size_t> indices(offsets.back());
+		Worker::ParallelFor(0, flags.size(), [&](size_t i) {
+			if (flags[i]) indices[offsets[i]] = i;
+		});
+		return indices;
 	}
 
-	double RayPointDist(const Vec3d &rayBase, const Vec3d &rayDirection, const Vec3d  p) {
-		Vec3d w = (p - rayBase);
-		Vec3d c = OpenMesh::cross(rayDirection, w);
-		return c.norm();
+	template <typename Handle>
+	std::vector<Handle> ToHandles(const std::vector<size_t>& indices) {
+		std::vector<Handle> handles(indices.size());
+		for (size_t i = 0; i < indices.size(); ++i) handles[i] = Handle((int)indices[i]);
+		return handles;
 	}
 }
 
@@ -118,6 +214,15 @@ void Renderer::Terminate() {
 			delete shader[i];
 		}
 	}
+	id_shader_->Free();
+	delete id_shader_;
+	Profiler::Instance().Terminate();
+	glDeleteBuffers(1, &frame_data_buffer_);
+	if (pick_framebuffer_) {
+		glDeleteFramebuffers(1, &pick_framebuffer_);
+		glDeleteRenderbuffers(1, &pick_id_buffer_);
+		glDeleteRenderbuffers(1, &pick_depth_buffer_);
+	}
 }
 
 Renderer::Renderer() 
@@ -132,7 +237,8 @@ Renderer::Renderer()
 	up(0.0f, 1.0f, 0.0f),
 	arcball(),
 	
-	updated_geometry_(true) {
+	updated_geometry_(true),
+	redraw_requested_(true) {
 
 	ResetCamera();
 
@@ -163,9 +269,20 @@ Renderer::Renderer()
 	normal_shader_list.push_back(EdgeNormals);
 	normal_shader_list.push_back(FaceNormals);
 
+	// these only draw a few highlighted elements
+	sparse_shader_list.push_back(SingleEdge);
+	sparse_shader_list.push_back(PickerEdge);
+	sparse_shader_list.push_back(PickerVertex);
+	sparse_shader_list.push_back(PickerFace);
+
 	// ====== Create Shaders ======
 	shader[Shaded] = new BasicShader("phong", "phong");
 
+	for (enum Render mode : sparse_shader_list) {
+		const std::string geom = mode == PickerFace ? "triangle" : "line";
+		shader[mode] = sparse_shader[mode] = new SparseShader("sparse_color", "in_color", geom);
+	}
+
 	for (enum Render mode : edge_shader_list) {
 		if (shader[mode]) continue;
 		shader[mode] = edge_shader[mode] = new EdgeShader("in_color", "in_color", "line");
@@ -186,14 +303,37 @@ Renderer::Renderer()
 		shader[mode] = face_shader[mode] = new FaceShader("in_color", "in_color", "triangle");
 	}
 
+	id_shader_ = new BasicShader("id", "id");
+	UpdateColorFormat();
+
+	// ====== Profiler sections ======
+	Profiler& profiler = Profiler::Instance();
+	profile_upload_ = profiler.Section("Upload Mesh");
+	profile_positions_ = profiler.Section("Update Positions");
+	profile_pick_ = profiler.Section("Pick");
+	for (int i = 0; i < Render::N_RENDER_MODES; ++i) {
+		profile_update_[i] = profiler.Section(std::string("Update ") + RenderName((enum Render)i));
+		profile_render_[i] = profiler.Section(std::string("Render ") + RenderName((enum Render)i));
+	}
+
+	// ====== Per-frame uniforms ======
+	glGenBuffers(1, &frame_data_buffer_);
+	glBindBuffer(GL_UNIFORM_BUFFER, frame_data_buffer_);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, frame_data_binding, frame_data_buffer_);
+	for (int i = 0; i < Render::N_RENDER_MODES; ++i) {
+		if (shader[i]) shader[i]->BindUniformBlock("FrameData", frame_data_binding);
+	}
+	id_shader_->BindUniformBlock("FrameData", frame_data_binding);
+
 	// ====== Set Render function ======
 	for (enum Render mode : face_shader_list) {
 		BasicShader* s = shader[mode];
 		s->SetRenderFunc([s, this]() {
 			glDepthMask(GL_TRUE);
 			s->Bind();
-			s->SetUniform("modelViewProjMatrix", modelViewProj);
-			s->DrawArray();
+			s->Draw();
 		});
 	}
 
@@ -209,8 +349,7 @@ Renderer::Renderer()
 					glDisable(GL_DEPTH_TEST);
 				}
 				s->Bind();
-				s->SetUniform("modelViewProjMatrix", modelViewProj);
-				s->DrawArray();
+				s->Draw();
 			});
 		}
 	}
@@ -218,31 +357,25 @@ Renderer::Renderer()
 	shader[Shaded]->SetRenderFunc([this]() {
 		glDepthMask(GL_TRUE);
 		shader[Shaded]->Bind();
-		shader[Shaded]->SetUniform("modelViewProjMatrix", modelViewProj);
-		shader[Shaded]->SetUniform("modelViewMatrix", modelView);
-		shader[Shaded]->SetUniform("normalMatrix", normalmatrix);
-		shader[Shaded]->SetUniform("viewMatrix", glm::mat3(view));
-		shader[Shaded]->SetUniform("l0Position", l0Position);
-		shader[Shaded]->SetUniform("l1Position", l1Position);
-		shader[Shaded]->SetUniform("l2Position", l2Position);
+		// matrices and lights are in FrameData
 		shader[Shaded]->SetUniform("DiffuseMaterial", DiffuseMaterial);
 		shader[Shaded]->SetUniform("AmbientMaterial", AmbientMaterial);
 		shader[Shaded]->SetUniform("SpecularMaterial", SpecularMaterial);
-		shader[Shaded]->SetUniform("l0Intensity", l0Intensity);
-		shader[Shaded]->SetUniform("l1Intensity", l1Intensity);
-		shader[Shaded]->SetUniform("l2Intensity", l2Intensity);
 		shader[Shaded]->SetUniform("ambient_intensity", phong_ambient_intensity);
 		shader[Shaded]->SetUniform("diffuse_intensity", phong_diffuse_intensity);
 		shader[Shaded]->SetUniform("specular_intensity", phong_specular_intensity);
 		shader[Shaded]->SetUniform("shininess", phong_specular_shininess);
-		shader[Shaded]->DrawArray();
+		if (shaded_indexed_) {
+			shader[Shaded]->DrawIndexed();
+		} else {
+			shader[Shaded]->DrawArray();
+		}
 	});
 
 	shader[Solid]->SetRenderFunc([this]() {
 		glDepthMask(GL_TRUE);
 		//glDepthFunc(GL_ALWAYS);
 		shader[Solid]->Bind();
-		shader[Solid]->SetUniform("modelViewProjMatrix", modelViewProj);
 		shader[Solid]->DrawArray();
 		//glDepthFunc(GL_LEQUAL);
 	});
@@ -253,15 +386,15 @@ Renderer::Renderer()
 	SetBoundaryColor();
 	SetFeatureColor();
 
-	edge_shader[SingleEdge]->SetColorFunc(
-		[&](EdgeHandle e, unsigned int) -> Color {
-		for (int i = 0; i < selected_edge_id.size(); ++i) {
-			if (e.idx() == selected_edge_id[i]) {
-				ImColor c = selected_edge_color[i];
-				return Converters::convert(c);
-			}
+	sparse_shader[SingleEdge]->SetElementsFunc([this]() {
+		std::vector<SparseShader::Element> elements;
+		for (size_t i = 0; i < selected_edge_id.size(); ++i) {
+			const int e = selected_edge_id[i];
+			if (e < 0 || e >= (int)cmesh().n_edges()) continue;
+			const Color c = Converters::convert(selected_edge_color[i]);
+			elements.push_back({ uint32_t(2 * e), 2, c, c });
 		}
-		return Color::Empty();
+		return elements;
 	});
 
 	custom_shader[VertexNormals]->SetColorFunc([]() {
@@ -306,94 +439,305 @@ Renderer::Renderer()
 		return Color::Red();
 	});
 
-	face_shader[PickerFace]->SetColorFunc(
-		[this](const FaceHandle f, const VertexHandle) -> Color {
-		if (f == picked_face) return Color::Red();
-		return Color::Empty();
+	// the soup and edge buffers have the elements of face f and edge e at
+	// 3 * face_triangle_offset_[f] and 2 * e
+	sparse_shader[PickerFace]->SetElementsFunc([this]() {
+		std::vector<SparseShader::Element> elements;
+		const int f = picked_face.idx();
+		if (f < 0 || f + 1 >= (int)face_triangle_offset_.size()) return elements;
+		const uint32_t first = 3 * face_triangle_offset_[f];
+		const uint32_t count = 3 * (face_triangle_offset_[f + 1] - face_triangle_offset_[f]);
+		elements.push_back({ first, count, Color::Red(), Color::Red() });
+		return elements;
 	});
-	edge_shader[PickerEdge]->SetColorFunc(
-		[this](const EdgeHandle e, const unsigned int) -> Color {
-		if (e == picked_edge) return Color::Red();
-		return Color::Empty();
+	sparse_shader[PickerEdge]->SetElementsFunc([this]() {
+		std::vector<SparseShader::Element> elements;
+		if (!picked_edge.is_valid() || picked_edge.idx() >= (int)cmesh().n_edges()) return elements;
+		elements.push_back({ uint32_t(2 * picked_edge.idx()), 2, Color::Red(), Color::Red() });
+		return elements;
 	});
-	edge_shader[PickerVertex]->SetColorFunc(
-		[this](const EdgeHandle e, const unsigned int i) -> Color {
-		const HalfedgeHandle he = cmesh().halfedge_handle(e, i);
-		if (cmesh().from_vertex_handle(he) == picked_vertex) {
-			return Color::Red();
+	sparse_shader[PickerVertex]->SetElementsFunc([this]() {
+		// the edges around the vertex, fading out from it
+		std::vector<SparseShader::Element> elements;
+		const VertexHandle v = picked_vertex;
+		if (!v.is_valid() || v.idx() >= (int)cmesh().n_vertices()) return elements;
+		for (const HalfedgeHandle he : cmesh().voh_range(v)) {
+			const EdgeHandle e = cmesh().edge_handle(he);
+			const bool even = cmesh().halfedge_handle(e, 0) == he;
+			elements.push_back({ uint32_t(2 * e.idx()), 2,
+				even ? Color::Red() : Color::Empty(), even ? Color::Empty() : Color::Red() });
 		}
-		return Color::Empty();
+		return elements;
 	});
 }
 
-void Renderer::UploadMeshData() {
+void Renderer::BuildShadedIndexed(Eigen::Matrix3Xf& positions, Eigen::Matrix3Xf& normals,
+	Eigen::Matrix<uint32_t, 3, Eigen::Dynamic>& indices) {
 	using namespace Converters;
 
-	mesh().update_normals();
+	// every face corner, stored by its halfedge pointing to the vertex, goes to
+	// a copy of the vertex. Corners share a copy if their good_normal is the same, 
+	// so vertices are only split along feature edges
+	const size_t n_vertices = cmesh().n_vertices();
+	const float same_normal_eps = 1e-6f; // squared distance between unit normals
+	std::vector<Vector3f> corner_normal(cmesh().n_halfedges());
+	std::vector<uint32_t> n_copies(n_vertices);
+	corner_split_.assign(cmesh().n_halfedges(), 0);
+	Worker::ParallelChunks(0, n_vertices, [&](size_t, size_t begin, size_t end) {
+		std::vector<HalfedgeHandle> copies; // first corner of every copy of the vertex
+		for (size_t vi = begin; vi < end; ++vi) {
+			const VertexHandle v((int)vi);
+			copies.clear();
+			for (const HalfedgeHandle he : cmesh().vih_range(v)) {
+				const FaceHandle f = cmesh().face_handle(he);
+				if (!f.is_valid()) continue;
+				const Vector3f n = d2f(cmesh().good_normal(v, f));
+				corner_normal[he.idx()] = n;
+				uint32_t copy = 0;
+				while (copy < copies.size() && 
+					(corner_normal[copies[copy].idx()] - n).squaredNorm() > same_normal_eps) ++copy;
+				if (copy == copies.size()) copies.push_back(he);
+				corner_split_[he.idx()] = copy;
+			}
+			n_copies[vi] = (uint32_t)copies.size();
+		}
+	});
+
+	// copies of the same vertex are next to each other, in vertex order
+	Worker::ParallelPrefixSum(n_vertices, vertex_split_offset_, 
+		[&n_copies](size_t vi) { return n_copies[vi]; });
+	const uint32_t n_split = vertex_split_offset_.back();
+
+	positions.resize(3, n_split);
+	normals.resize(3, n_split);
+	split_face_.resize(n_split);
+	Worker::ParallelFor(0, n_vertices, [&](size_t vi) {
+		const VertexHandle v((int)vi);
+		const uint32_t offset = vertex_split_offset_[vi];
+		uint32_t written = 0;
+		for (const HalfedgeHandle he : cmesh().vih_range(v)) {
+			if (cmesh().is_boundary(he)) continue;
+			const uint32_t copy = corner_split_[he.idx()];
+			if (copy == written) {
+				positions.col(offset + copy) = d2f(cmesh().point(v));
+				normals.col(offset + copy) = corner_normal[he.idx()];
+				split_face_[offset + copy] = cmesh().face_handle(he);
+				++written;
+			}
+			corner_split_[he.idx()] = offset + copy;
+		}
+	});
 
-	float average_edge_length = (float)mesh().calc_average_edge_length();
-	double normal_length_factor = average_edge_length * 0.8;
+	indices.resize(3, face_triangle_offset_.back());
+	Worker::ParallelFor(0, cmesh().n_faces(), [&](size_t f) {
+		WriteFaceIndices(FaceHandle((int)f), face_triangle_offset_[f], corner_split_, indices);
+	});
+}
 
-	size_t i;
-	GLuint n_vertices = static_cast<GLuint>(cmesh().n_vertices());
-	GLuint n_faces = static_cast<GLuint>(cmesh().n_faces());
-	GLuint n_edges = static_cast<GLuint>(cmesh().n_edges());
-	GLuint n_halfedges = static_cast<GLuint>(cmesh().n_halfedges());
-	GLuint n_triangles = 0;
-	for (FaceHandle f : cmesh().faces()) {
-		GLuint face_triangles = cmesh().valence(f) - 2;
-		n_triangles += face_triangles;
+void Renderer::UploadPositions(enum Render mode, const Eigen::Matrix3Xf& positions) {
+	if (!quantized_positions_) {
+		shader[mode]->UploadAttrib("position", positions);
+		return;
 	}
-	assert(n_triangles >= n_faces);
-	
-	i = 0; // triangle vertex index
-	Eigen::Matrix3Xf face_vertices(3, n_triangles * 3);
-	Eigen::Matrix3Xf face_normals(3, n_triangles * 3);
-	for (FaceHandle f : cmesh().faces()) {
-		// this is basically a triangle fan for any face valence
-		MyMesh::ConstFaceVertexCCWIter it = cmesh().cfv_ccwbegin(f);
-		VertexHandle first = *it;
-		++it;
-		size_t face_triangles = cmesh().valence(f) - 2;
-		for (int j = 0; j < face_triangles; ++j) {
-			face_vertices.col(i + 0) = d2f(cmesh().point(first));
-			face_normals.col(i + 0) = d2f(cmesh().good_normal(first, f));
+	QuantizedPositions quantized;
+	const float error = QuantizePositions(positions, position_offset_, position_scale_, quantized);
+	position_error_ = std::max(position_error_, error);
+	shader[mode]->UploadAttrib("position", quantized);
+}
 
-			face_vertices.col(i + 1) = d2f(cmesh().point(*it));
-			face_normals.col(i + 1) = d2f(cmesh().good_normal(*it, f));
-			++it;
-			face_vertices.col(i + 2) = d2f(cmesh().point(*it));
-			face_normals.col(i + 2) = d2f(cmesh().good_normal(*it, f));
-			i += 3;
-		}
+bool Renderer::UploadPositionsRange(enum Render mode, const Eigen::Matrix3Xf& positions, uint32_t first) {
+	if (!quantized_positions_) {
+		shader[mode]->UploadAttribRange("position", positions, first);
+		return true;
 	}
-	shader[Shaded]->Bind();
-	shader[Shaded]->UploadAttrib("position", face_vertices);
-	shader[Shaded]->UploadAttrib("normal", face_normals);
-	shader[Shaded]->SetPrimitives(GL_TRIANGLES, n_triangles * 3);
-	for (enum Render mode : face_shader_list) {
-		if (shader[mode]) {
-			shader[mode]->Bind();
-			shader[mode]->ShareAttrib(*shader[Shaded], "position");
-			shader[mode]->SetPrimitives(GL_TRIANGLES, n_triangles * 3);
+	QuantizedPositions quantized;
+	const float error = QuantizePositions(positions, position_offset_, position_scale_, quantized);
+	if (error == std::numeric_limits<float>::infinity()) return false;
+	shader[mode]->UploadAttribRange("position", quantized, first);
+	return true;
+}
+
+void Renderer::UploadNormals(enum Render mode, const Eigen::Matrix3Xf& normals) {
+	if (!octahedral_normals_) {
+		shader[mode]->UploadAttrib("normal", normals);
+		return;
+	}
+	OctahedralNormals encoded;
+	normal_error_ = std::max(normal_error_, EncodeOctahedral(normals, encoded));
+	shader[mode]->UploadAttrib("normal", encoded);
+}
+
+void Renderer::UploadNormalsRange(enum Render mode, const Eigen::Matrix3Xf& normals, uint32_t first) {
+	if (!octahedral_normals_) {
+		shader[mode]->UploadAttribRange("normal", normals, first);
+		return;
+	}
+	OctahedralNormals encoded;
+	EncodeOctahedral(normals, encoded);
+	shader[mode]->UploadAttribRange("normal", encoded, first);
+}
+
+void Renderer::SetVertexFormat() {
+	quantized_positions_ = quantized_positions;
+	octahedral_normals_ = octahedral_normals;
+	position_error_ = 0.0f;
+	normal_error_ = 0.0f;
+	position_offset_ = Vector3f::Zero();
+	position_scale_ = Vector3f::Ones();
+	if (quantized_positions_) {
+		// the box has room for the normal lines, and a margin so moving 
+		// vertices a little does not need a full upload
+		typedef std::pair<Vec3d, Vec3d> Box;
+		const double inf = std::numeric_limits<double>::infinity();
+		const Box box = Worker::ParallelReduce(0, cmesh().n_vertices(), 
+			Box(Vec3d(inf, inf, inf), Vec3d(-inf, -inf, -inf)),
+			[](size_t v) {
+				const Vec3d& p = cmesh().point(VertexHandle((int)v));
+				return Box(p, p);
+			}, [](Box a, const Box& b) {
+				a.first.minimize(b.first);
+				a.second.maximize(b.second);
+				return a;
+			});
+		if (box.first[0] <= box.second[0]) {
+			const double margin = normal_length_factor_ + 0.01 * (box.second - box.first).max();
+			for (int axis = 0; axis < 3; ++axis) {
+				const double min = box.first[axis] - margin;
+				const double extent = box.second[axis] - box.first[axis] + 2 * margin;
+				position_offset_[axis] = (float)min;
+				position_scale_[axis] = extent > 0.0 ? (float)extent : 1.0f;
+			}
 		}
 	}
-	assert(i == n_triangles * 3);
 
-	i = 0; // edge index;
+	const glm::vec3 offset(position_offset_.x(), position_offset_.y(), position_offset_.z());
+	const glm::vec3 scale(position_scale_.x(), position_scale_.y(), position_scale_.z());
+	std::vector<BasicShader*> shaders(shader, shader + Render::N_RENDER_MODES);
+	shaders.push_back(id_shader_);
+	for (BasicShader* s : shaders) {
+		if (!s) continue;
+		s->Bind();
+		s->SetUniform("position_offset", offset, false);
+		s->SetUniform("position_scale", scale, false);
+		s->SetUniform("octahedral_normals", octahedral_normals_ ? 1 : 0, false);
+	}
+}
+
+void Renderer::UploadMeshData(bool report) {
+	TRACE_FUNCTION();
+	const double start = glfwGetTime();
+
+	// loading and UpdatePositions keep them up to date, they are only recomputed
+	// after the vertices moved some other way
+	if (!cmesh().features_cached()) {
+		mesh().update_normals_parallel();
+		mesh().update_features();
+	}
+
+	normal_length_factor_ = mesh().calc_average_edge_length() * 0.8;
+
+	const GLuint n_vertices = static_cast<GLuint>(cmesh().n_vertices());
+	const GLuint n_faces = static_cast<GLuint>(cmesh().n_faces());
+	const GLuint n_edges = static_cast<GLuint>(cmesh().n_edges());
+	const GLuint n_halfedges = static_cast<GLuint>(cmesh().n_halfedges());
+	// the triangles of face f are [face_triangle_offset_[f], face_triangle_offset_[f + 1])
+	Worker::ParallelPrefixSum(n_faces, face_triangle_offset_, [](size_t f) {
+		return GLuint(cmesh().valence(FaceHandle((int)f)) - 2);
+	});
+	const GLuint n_triangles = face_triangle_offset_.back();
+	assert(n_triangles >= n_faces);
+	uploaded_vertices_ = n_vertices;
+	uploaded_faces_ = n_faces;
+	uploaded_edges_ = n_edges;
+
+	// the other face modes color every triangle corner on its own, so they keep
+	// using the triangle soup. Shaded only needs it when not indexed
+	const bool indexed = indexed_shading;
+	const enum Render soup_owner = indexed ? Solid : Shaded;
+	Eigen::Matrix3Xf face_vertices(3, n_triangles * 3);
+	Eigen::Matrix3Xf face_normals(3, indexed ? 0 : n_triangles * 3);
+	Eigen::Matrix3Xf shaded_vertices;
+	Eigen::Matrix3Xf shaded_normals;
+	Eigen::Matrix<uint32_t, 3, Eigen::Dynamic> shaded_indices;
 	Eigen::Matrix3Xf edge_vertices(3, n_edges * 2);
 	Eigen::Matrix3Xf edge_normals(3, n_edges * 2);
-	for (EdgeHandle e : cmesh().edges()) {
-		HalfedgeHandle he = cmesh().halfedge_handle(e, 0);
-		edge_vertices.col(i + 0) = d2f(cmesh().point(cmesh().from_vertex_handle(he)));
-		edge_vertices.col(i + 1) = d2f(cmesh().point(cmesh().to_vertex_handle(he)));
-		edge_normals.col(i + 0) = d2f(cmesh().normal(e));
-		edge_normals.col(i + 1) = d2f(cmesh().normal(e));
-		i += 2;
+	Eigen::Matrix3Xf vertnormal_vertices(3, n_vertices * 2);
+	Eigen::Matrix3Xf halfedgenormal_vertices(3, n_halfedges * 2);
+	Eigen::Matrix3Xf facenormal_vertices(3, n_faces * 2);
+
+	// the buffers do not depend on each other, so they are all built at the same 
+	// time. Only this thread can use OpenGL, so the uploads wait for all of them
+	std::vector<TaskFuture<void>> buffers;
+	buffers.push_back(Worker::Submit([&]() {
+		Worker::ParallelFor(0, n_faces, [&](size_t f) {
+			WriteFaceTriangles(FaceHandle((int)f), 3 * face_triangle_offset_[f],
+				face_vertices, indexed ? nullptr : &face_normals);
+		});
+	}));
+	if (indexed) {
+		buffers.push_back(Worker::Submit([&]() {
+			BuildShadedIndexed(shaded_vertices, shaded_normals, shaded_indices);
+		}));
+	}
+	buffers.push_back(Worker::Submit([&]() {
+		Worker::ParallelFor(0, n_edges, [&](size_t e) {
+			WriteEdge(EdgeHandle((int)e), 2 * e, edge_vertices, edge_normals);
+		});
+	}));
+	buffers.push_back(Worker::Submit([&]() {
+		Worker::ParallelFor(0, n_vertices, [&](size_t v) {
+			WriteVertexNormalLine(VertexHandle((int)v), 2 * v, normal_length_factor_, vertnormal_vertices);
+		});
+	}));
+	buffers.push_back(Worker::Submit([&]() {
+		Worker::ParallelFor(0, n_halfedges, [&](size_t he) {
+			WriteHalfedgeNormalLine(HalfedgeHandle((int)he), 2 * he, normal_length_factor_, halfedgenormal_vertices);
+		});
+	}));
+	buffers.push_back(Worker::Submit([&]() {
+		Worker::ParallelFor(0, n_faces, [&](size_t f) {
+			WriteFaceNormalLine(FaceHandle((int)f), 2 * f, normal_length_factor_, facenormal_vertices);
+		});
+	}));
+	for (const TaskFuture<void>& buffer : buffers) {
+		buffer.Wait();
+		buffer.get(); // rethrows if building the buffer failed
+	}
+	const double built = glfwGetTime();
+
+	SetVertexFormat();
+	shader[soup_owner]->Bind();
+	UploadPositions(soup_owner, face_vertices);
+	shader[soup_owner]->SetPrimitives(GL_TRIANGLES, n_triangles * 3);
+	for (enum Render mode : face_shader_list) {
+		if (mode == soup_owner || mode == Shaded || !shader[mode]) continue;
+		shader[mode]->Bind();
+		shader[mode]->FreeAttrib("position");
+		shader[mode]->ShareAttrib(*shader[soup_owner], "position");
+		shader[mode]->SetPrimitives(GL_TRIANGLES, n_triangles * 3);
+	}
+	id_shader_->Bind();
+	id_shader_->FreeAttrib("position");
+	id_shader_->ShareAttrib(*shader[soup_owner], "position");
+	id_shader_->SetPrimitives(GL_TRIANGLES, n_triangles * 3);
+	shader[Shaded]->Bind();
+	if (indexed) {
+		UploadPositions(Shaded, shaded_vertices);
+		UploadNormals(Shaded, shaded_normals);
+		shader[Shaded]->UploadIndices(shaded_indices);
+		shader[Shaded]->SetPrimitives(GL_TRIANGLES, n_triangles);
+	} else {
+		UploadNormals(Shaded, face_normals);
+		shader[Shaded]->FreeAttrib("indices");
+		vertex_split_offset_.clear();
+		corner_split_.clear();
+		split_face_.clear();
 	}
+	shaded_indexed_ = indexed;
+
 	shader[Wireframe]->Bind();
-	shader[Wireframe]->UploadAttrib("position", edge_vertices);
-	shader[Wireframe]->UploadAttrib("normal", edge_normals);
+	UploadPositions(Wireframe, edge_vertices);
+	UploadNormals(Wireframe, edge_normals);
 	shader[Wireframe]->SetPrimitives(GL_LINES, n_edges * 2);
 	for (enum Render mode : edge_shader_list) {
 		if (shader[mode]) {
@@ -403,81 +747,336 @@ void Renderer::UploadMeshData() {
 			shader[mode]->SetPrimitives(GL_LINES, n_edges * 2);
 		}
 	}
-	assert(i == n_edges * 2);
-	
-	//i = 0; // halfedge index
-	//Eigen::Matrix3Xf halfedge_vertices(3, n_halfedges * 2);
-	//Eigen::Matrix3Xf halfedge_normals(3, n_halfedges * 2);
-	//for (HalfedgeHandle he : cmesh().halfedges()) {
-	//	FaceHandle f = cmesh().face_handle(he);
-	//	if (!f.is_valid()) { // use opposite face as fallback
-	//		HalfedgeHandle opp = cmesh().opposite_halfedge_handle(he);
-	//		f = cmesh().face_handle(opp);
-	//	}
-	//	Vector3f normal = convert(f.is_valid() ? cmesh().normal(f) : cmesh().normal(he));
-	//	Vector3f vector = convert(cmesh().vector(he));
-	//	normal.normalize();
-	//	vector.normalize();
-	//	Vector3f left = normal.cross(vector);
-	//	Vector3f from = convert(cmesh().point(cmesh().from_vertex_handle(he)));
-	//	Vector3f to = convert(cmesh().point(cmesh().to_vertex_handle(he)));
-	//	halfedge_vertices.col(i + 0) = from + left * halfedge_side_offset;
-	//	halfedge_vertices.col(i + 1) = to + left * halfedge_side_offset;
-	//	halfedge_normals.col(i + 0) = normal;
-	//	halfedge_normals.col(i + 1) = normal;
-	//	i += 2;
-	//}
-	//assert(i == n_halfedges * 2);
 
-	i = 0; // vert normal index
-	Eigen::Matrix3Xf vertnormal_vertices(3, n_vertices * 2);
-	for (VertexHandle v : cmesh().vertices()) {
-		vertnormal_vertices.col(i + 0) = d2f(cmesh().point(v));
-		vertnormal_vertices.col(i + 1) = d2f(cmesh().point(v) + cmesh().normal(v) * normal_length_factor);
-		i += 2;
-	}
 	shader[VertexNormals]->Bind();
-	shader[VertexNormals]->UploadAttrib("position", vertnormal_vertices);
+	UploadPositions(VertexNormals, vertnormal_vertices);
 	shader[VertexNormals]->SetPrimitives(GL_LINES, n_vertices * 2);
-	assert(i == n_vertices * 2);
 
-	i = 0; // halfedge normal index
-	Eigen::Matrix3Xf halfedgenormal_vertices(3, n_halfedges * 2);
-	for (HalfedgeHandle he : cmesh().halfedges()) {
-		Vec3d normal = halfedge_normal(he);
-		Vec3d from = cmesh().midpoint(he);
-		normal *= normal_length_factor;
-		halfedgenormal_vertices.col(i + 0) = d2f(from);
-		halfedgenormal_vertices.col(i + 1) = d2f(from + normal);
-		i += 2;
-	}
 	shader[EdgeNormals]->Bind();
-	shader[EdgeNormals]->UploadAttrib("position", halfedgenormal_vertices);
+	UploadPositions(EdgeNormals, halfedgenormal_vertices);
 	shader[EdgeNormals]->SetPrimitives(GL_LINES, n_halfedges * 2);
-	assert(i == n_halfedges * 2);
 
-	i = 0;
-	Eigen::Matrix3Xf facenormal_vertices(3, n_faces * 2);
-	for (FaceHandle f : cmesh().faces()) {
-		facenormal_vertices.col(i + 0) = d2f(cmesh().midpoint(f));
-		Vec3d normal = cmesh().normal(f) * normal_length_factor;
-		facenormal_vertices.col(i + 1) = facenormal_vertices.col(i) + d2f(normal);
-		i += 2;
-	}
 	shader[FaceNormals]->Bind();
-	shader[FaceNormals]->UploadAttrib("position", facenormal_vertices);
+	UploadPositions(FaceNormals, facenormal_vertices);
 	shader[FaceNormals]->SetPrimitives(GL_LINES, n_faces * 2);
-	assert(i == n_faces * 2);
 
 	UpdateLineThickness();
 	//UpdateLineBump();
 
+	// the old hierarchy may point to vertices that are gone, picking waits for the new one
+	bvh_.reset();
+	bvh_refit_pending_ = false;
+	{
+		// the mesh cannot be replaced from now until StopMeshTasks waited for it
+		std::lock_guard<std::mutex> lock(mesh_tasks_mutex_);
+		if (cmesh().render_ready) {
+			bvh_build_ = Worker::Submit([]() {
+				std::shared_ptr<FaceBVH> bvh = std::make_shared<FaceBVH>();
+				bvh->Build(cmesh());
+				return bvh;
+			}, {}, "Build BVH", Priority::Low);
+		}
+	}
+
+	const double uploaded = glfwGetTime();
+	upload_build_time_ = built - start;
+	upload_gl_time_ = uploaded - built;
+	if (!report) return;
+
 	print("Uploading mesh data\n");
 	print("n_vertices: %lu\n", n_vertices);
 	print("n_faces: %lu\n", n_faces);
 	print("n_triangles: %lu\n", n_triangles);
 	print("n_edges: %lu\n", n_edges);
 	print("n_halfedges: %lu\n", n_halfedges);
+
+	const size_t position_bytes = quantized_positions_ ? 3 * sizeof(uint16_t) : sizeof(Vector3f);
+	const size_t normal_bytes = octahedral_normals_ ? 2 * sizeof(uint16_t) : sizeof(Vector3f);
+	const size_t soup_bytes = size_t(n_triangles) * 3 * (position_bytes + normal_bytes);
+	const size_t shaded_bytes = indexed ? 
+		size_t(shaded_vertices.cols()) * (position_bytes + normal_bytes) + 
+		size_t(shaded_indices.size()) * sizeof(uint32_t) : soup_bytes;
+	print("Shaded (%s): %.1f MB instead of %.1f MB as triangle soup\n",
+		indexed ? "indexed" : "soup", shaded_bytes / 1e6, soup_bytes / 1e6);
+	if (quantized_positions_) {
+		const float bound = position_scale_.maxCoeff() / 65535.0f / 2.0f;
+		print("16-bit positions: max error %g, bound %g (%.1e of the box)\n", 
+			position_error_, bound, 1.0 / 65535.0 / 2.0);
+	}
+	if (octahedral_normals_) {
+		print("Octahedral normals: max error %.4f degrees\n", Utils::ToDeg(normal_error_));
+	}
+	print("Buffers built in %.0f ms on %lu threads, uploaded in %.0f ms\n",
+		upload_build_time_ * 1000, (unsigned long)Worker::Concurrency(), upload_gl_time_ * 1000);
+}
+
+void Renderer::InvalidatePositions(size_t begin, size_t end) {
+	if (end <= begin) return;
+	{
+		std::lock_guard<std::mutex> lock(dirty_mutex_);
+		dirty_vertices_.push_back(std::make_pair(begin, end));
+	}
+	RequestRedraw();
+}
+
+bool Renderer::UpdatePositions(const std::vector<std::pair<size_t, size_t>>& moved_ranges) {
+	using namespace Converters;
+
+	const size_t n_vertices = cmesh().n_vertices();
+	const size_t n_faces = cmesh().n_faces();
+	const size_t n_edges = cmesh().n_edges();
+	if (n_vertices != uploaded_vertices_ || n_faces != uploaded_faces_ || 
+		n_edges != uploaded_edges_ || shaded_indexed_ != indexed_shading) {
+		mesh().invalidate_features(); // the normals around the moved vertices are old
+		return false;
+	}
+	const double start = glfwGetTime();
+
+	// ==== What changed ====
+	// faces with a moved vertex get a new normal, so do the vertices and edges around them
+	std::vector<char> moved(n_vertices, 0);
+	for (const auto& range : moved_ranges) {
+		std::fill(moved.begin() + std::min(range.first, n_vertices), 
+			moved.begin() + std::min(range.second, n_vertices), 1);
+	}
+	std::vector<char> face_changed(n_faces);
+	Worker::ParallelFor(0, n_faces, [&](size_t f) {
+		char changed = 0;
+		for (const VertexHandle v : cmesh().fv_range(FaceHandle((int)f))) changed |= moved[v.idx()];
+		face_changed[f] = changed;
+	});
+	std::vector<char> vertex_changed(n_vertices);
+	Worker::ParallelFor(0, n_vertices, [&](size_t v) {
+		char changed = moved[v];
+		for (const FaceHandle f : cmesh().vf_range(VertexHandle((int)v))) changed |= face_changed[f.idx()];
+		vertex_changed[v] = changed;
+	});
+	std::vector<char> edge_changed(n_edges);
+	Worker::ParallelFor(0, n_edges, [&](size_t e) {
+		char changed = 0;
+		for (int side = 0; side < 2; ++side) {
+			const HalfedgeHandle he = cmesh().halfedge_handle(EdgeHandle((int)e), side);
+			const FaceHandle f = cmesh().face_handle(he);
+			changed |= moved[cmesh().to_vertex_handle(he).idx()];
+			if (f.is_valid()) changed |= face_changed[f.idx()];
+		}
+		edge_changed[e] = changed;
+	});
+	const std::vector<size_t> faces = FlagIndices(face_changed);
+	const std::vector<size_t> vertices = FlagIndices(vertex_changed);
+	const std::vector<size_t> edges = FlagIndices(edge_changed);
+	std::vector<HalfedgeHandle> halfedges;
+	halfedges.reserve(edges.size() * 2);
+	for (const size_t e : edges) {
+		halfedges.push_back(cmesh().halfedge_handle(EdgeHandle((int)e), 0));
+		halfedges.push_back(cmesh().halfedge_handle(EdgeHandle((int)e), 1));
+	}
+
+	mesh().update_face_normals_parallel(ToHandles<FaceHandle>(faces));
+	mesh().update_vertex_normals_parallel(ToHandles<VertexHandle>(vertices));
+	mesh().update_halfedge_normals_parallel(halfedges);
+	// a new feature edge changes how vertices are split, start over
+	if (!mesh().update_features(ToHandles<EdgeHandle>(edges))) return false;
+
+	// ==== Upload ====
+	// rewriting a few unchanged elements is cheaper than one more upload
+	const size_t max_gap = 32;
+
+	// the soup normals of a face change when any of its vertices does
+	std::vector<size_t> soup_faces = faces;
+	if (!shaded_indexed_) {
+		Worker::ParallelFor(0, n_faces, [&](size_t f) {
+			char changed = 0;
+			for (const VertexHandle v : cmesh().fv_range(FaceHandle((int)f))) changed |= vertex_changed[v.idx()];
+			face_changed[f] = changed;
+		});
+		soup_faces = FlagIndices(face_changed);
+	}
+	const enum Render soup_owner = shaded_indexed_ ? Solid : Shaded;
+	for (const auto& range : Utils::Ranges(soup_faces, max_gap)) {
+		const size_t col = 3 * face_triangle_offset_[range.first];
+		const size_t n_cols = 3 * face_triangle_offset_[range.second] - col;
+		Eigen::Matrix3Xf positions(3, n_cols);
+		Eigen::Matrix3Xf normals(3, shaded_indexed_ ? 0 : n_cols);
+		Worker::ParallelFor(range.first, range.second, [&](size_t f) {
+			WriteFaceTriangles(FaceHandle((int)f), 3 * face_triangle_offset_[f] - col,
+				positions, shaded_indexed_ ? nullptr : &normals);
+		});
+		if (!UploadPositionsRange(soup_owner, positions, (uint32_t)col)) return false;
+		if (!shaded_indexed_) UploadNormalsRange(Shaded, normals, (uint32_t)col);
+	}
+
+	if (shaded_indexed_) {
+		// copies of a vertex keep the normal of the first corner that used them
+		for (const auto& range : Utils::Ranges(vertices, max_gap)) {
+			const size_t col = vertex_split_offset_[range.first];
+			const size_t n_cols = vertex_split_offset_[range.second] - col;
+			Eigen::Matrix3Xf positions(3, n_cols);
+			Eigen::Matrix3Xf normals(3, n_cols);
+			Worker::ParallelFor(range.first, range.second, [&](size_t v) {
+				const VertexHandle vh((int)v);
+				for (size_t copy = vertex_split_offset_[v]; copy < vertex_split_offset_[v + 1]; ++copy) {
+					positions.col(copy - col) = d2f(cmesh().point(vh));
+					normals.col(copy - col) = d2f(cmesh().good_normal(vh, split_face_[copy]));
+				}
+			});
+			if (!UploadPositionsRange(Shaded, positions, (uint32_t)col)) return false;
+			UploadNormalsRange(Shaded, normals, (uint32_t)col);
+		}
+	}
+
+	for (const auto& range : Utils::Ranges(edges, max_gap)) {
+		const size_t n = range.second - range.first;
+		Eigen::Matrix3Xf positions(3, 2 * n);
+		Eigen::Matrix3Xf normals(3, 2 * n);
+		Eigen::Matrix3Xf normal_lines(3, 4 * n); // two halfedges per edge
+		Worker::ParallelFor(range.first, range.second, [&](size_t e) {
+			const size_t i = e - range.first;
+			WriteEdge(EdgeHandle((int)e), 2 * i, positions, normals);
+			WriteHalfedgeNormalLine(HalfedgeHandle(2 * (int)e + 0), 4 * i + 0, normal_length_factor_, normal_lines);
+			WriteHalfedgeNormalLine(HalfedgeHandle(2 * (int)e + 1), 4 * i + 2, normal_length_factor_, normal_lines);
+		});
+		if (!UploadPositionsRange(Wireframe, positions, uint32_t(2 * range.first))) return false;
+		UploadNormalsRange(Wireframe, normals, uint32_t(2 * range.first));
+		if (!UploadPositionsRange(EdgeNormals, normal_lines, uint32_t(4 * range.first))) return false;
+	}
+
+	for (const auto& range : Utils::Ranges(vertices, max_gap)) {
+		Eigen::Matrix3Xf normal_lines(3, 2 * (range.second - range.first));
+		Worker::ParallelFor(range.first, range.second, [&](size_t v) {
+			WriteVertexNormalLine(VertexHandle((int)v), 2 * (v - range.first), normal_length_factor_, normal_lines);
+		});
+		if (!UploadPositionsRange(VertexNormals, normal_lines, uint32_t(2 * range.first))) return false;
+	}
+
+	for (const auto& range : Utils::Ranges(faces, max_gap)) {
+		Eigen::Matrix3Xf normal_lines(3, 2 * (range.second - range.first));
+		Worker::ParallelFor(range.first, range.second, [&](size_t f) {
+			WriteFaceNormalLine(FaceHandle((int)f), 2 * (f - range.first), normal_length_factor_, normal_lines);
+		});
+		if (!UploadPositionsRange(FaceNormals, normal_lines, uint32_t(2 * range.first))) return false;
+	}
+
+	// these are colored by normal
+	for (enum Render mode : normal_shader_list) {
+		shader[mode]->Invalidate();
+	}
+
+	if (bvh_) {
+		// a pick still running reads the current one, so refit a copy
+		if (pick_task_.valid() && !pick_task_.Handle()->Finished()) {
+			bvh_ = std::make_shared<FaceBVH>(*bvh_);
+		}
+		bvh_->Refit(cmesh());
+	} else {
+		bvh_refit_pending_ = true; // the one being built may have the old positions
+	}
+
+	upload_build_time_ = glfwGetTime() - start;
+	upload_gl_time_ = 0.0;
+	return true;
+}
+
+void Renderer::BenchmarkUpload() {
+	if (cmesh().n_vertices() == 0) return;
+	// the thread limit applies to every thread, so nothing else may run while it changes
+	StopMeshTasks();
+	if (!Worker::Idle()) {
+		print(LogLevel::Warning, "Upload benchmark skipped, wait for the running tasks\n");
+		return;
+	}
+	Worker::SetMaxConcurrency(0);
+	const size_t max_threads = Worker::Concurrency();
+	print("Upload benchmark, %lu faces\n", (unsigned long)cmesh().n_faces());
+	for (size_t threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+		StopMeshTasks(); // the BVH build started by the previous upload
+		Worker::SetMaxConcurrency(threads);
+		UploadMeshData(false);
+		print("%2lu threads: build %6.0f ms, upload %4.0f ms\n", (unsigned long)threads,
+			upload_build_time_ * 1000, upload_gl_time_ * 1000);
+		// the last upload uses all the threads, the default, so its BVH build can go on
+		if (threads == max_threads) break;
+	}
+}
+
+void Renderer::BenchmarkEdgeDraw() {
+	if (cmesh().n_edges() == 0) return;
+	const int draws = 50;
+	print("Edge draw benchmark, %lu edges\n", (unsigned long)cmesh().n_edges());
+	const std::pair<enum Render, const char*> modes[] = {
+		{ BoundaryEdges, "Boundary" }, { FeaturesEdges, "Features" } };
+	for (const auto& mode : modes) {
+		EdgeShader* s = edge_shader[mode.first];
+		s->Update();
+		double time[2];
+		for (int compact = 0; compact < 2; ++compact) {
+			s->SetCompactDraw(compact != 0);
+			glFinish();
+			const double start = glfwGetTime();
+			for (int i = 0; i < draws; ++i) {
+				s->Render();
+			}
+			glFinish();
+			time[compact] = (glfwGetTime() - start) / draws;
+		}
+		s->SetCompactDraw(true);
+		print("%s: %lu visible, all edges %.3f ms, visible only %.3f ms\n", mode.second,
+			(unsigned long)s->NumVisible(), time[0] * 1000, time[1] * 1000);
+	}
+}
+
+void Renderer::BenchmarkFrame() {
+	const int frames = 100;
+	glFinish();
+	const double start = glfwGetTime();
+	for (int i = 0; i < frames; ++i) {
+		Render();
+	}
+	const double cpu = (glfwGetTime() - start) / frames;
+	glFinish();
+	const double total = (glfwGetTime() - start) / frames;
+	print("Frame benchmark: Render() %.3f ms on the CPU, %.3f ms including the GPU\n",
+		cpu * 1000, total * 1000);
+}
+
+void Renderer::BenchmarkColors() {
+	if (cmesh().n_faces() == 0) return;
+	const int runs = 10;
+	const Eigen::Vector4f color = Converters::convert(solidcolor);
+	const auto time_updates = [runs](BasicShader* s) {
+		const double start = glfwGetTime();
+		for (int i = 0; i < runs; ++i) {
+			s->Invalidate();
+			s->Update();
+		}
+		return (glfwGetTime() - start) / runs * 1000;
+	};
+	print("Color update benchmark, %lu faces, %lu edges\n",
+		(unsigned long)cmesh().n_faces(), (unsigned long)cmesh().n_edges());
+
+	FaceShader* faces = face_shader[Solid];
+	faces->SetColorFunc([color](const FaceHandle, const VertexHandle) -> Color { return color; });
+	const double face_function = time_updates(faces);
+	faces->SetColors([color](Eigen::Matrix4Xf& colors) { colors.colwise() = color; });
+	const double face_fill = time_updates(faces);
+	faces->SetColorValues([](Eigen::VectorXf& values) {
+		Worker::ParallelFor(0, (size_t)values.size(), [&values](size_t f) {
+			values[f] = (float)cmesh().valence(FaceHandle((int)f));
+		});
+	});
+	const double face_values = time_updates(faces);
+	print("Faces: function %.1f ms, fill %.1f ms, values %.1f ms\n", 
+		face_function, face_fill, face_values);
+
+	EdgeShader* edges = edge_shader[Wireframe];
+	edges->SetColorFunc([color](const EdgeHandle, const unsigned int) -> Color { return color; });
+	const double edge_function = time_updates(edges);
+	edges->SetColors([color](Eigen::Matrix4Xf& colors) { colors.colwise() = color; });
+	const double edge_fill = time_updates(edges);
+	print("Edges: function %.1f ms, fill %.1f ms\n", edge_function, edge_fill);
+
+	SetSolidColor();
+	SetWireframeColor();
 }
 
 void Renderer::UpdateLineThickness() {
@@ -501,10 +1100,42 @@ void Renderer::UpdateLineThickness() {
 
 void Renderer::Render() {
 	if (width == 0 || height == 0) return;
+	TRACE_FUNCTION();
+	Profiler::Instance().BeginFrame();
+
+	// applies the pick started in an earlier frame, if it is done
+	FinishPick();
+
+	if (bvh_build_.valid() && bvh_build_.Handle()->Finished()) {
+		// a hierarchy finished just before the mesh was replaced is cancelled too
+		if (bvh_build_.Handle()->GetState() == Task::Done && !bvh_build_.Handle()->CancelRequested()) {
+			bvh_ = bvh_build_.get();
+			if (bvh_refit_pending_) bvh_->Refit(cmesh());
+		}
+		std::lock_guard<std::mutex> lock(mesh_tasks_mutex_);
+		bvh_build_ = TaskFuture<std::shared_ptr<FaceBVH>>();
+		bvh_refit_pending_ = false;
+	}
 
 	if (cmesh().render_ready) {
+		std::vector<std::pair<size_t, size_t>> moved;
+		{
+			std::lock_guard<std::mutex> lock(dirty_mutex_);
+			moved.swap(dirty_vertices_);
+		}
+		// a full upload covers the moved vertices too
+		if (!updated_geometry_ && !moved.empty()) {
+			mesh().invalidate_features();
+		} else if (!moved.empty()) {
+			Profiler::CpuScope scope(profile_positions_);
+			if (!UpdatePositions(moved)) updated_geometry_ = false;
+		}
+
 		if (!updated_geometry_) {
-			UploadMeshData();
+			{
+				Profiler::CpuScope scope(profile_upload_);
+				UploadMeshData();
+			}
 
 			updated_geometry_ = true;
 			for (int i = 0; i < Render::N_RENDER_MODES; ++i) {
@@ -517,6 +1148,7 @@ void Renderer::Render() {
 		if (cmesh().n_vertices() > 0) {
 			for (int i = 0; i < Render::N_RENDER_MODES; ++i) {
 				if (shader[i] && active[i]) {
+					Profiler::CpuScope scope(profile_update_[i]);
 					shader[i]->Update();
 				}
 			}
@@ -555,6 +1187,12 @@ void Renderer::Render() {
 	modelViewProj = projection * view * model;
 	modelView = view * model;
 	normalmatrix = glm::inverseTranspose(glm::mat3(modelView));
+	UploadFrameData();
+
+	if (pick_pending_) {
+		Profiler::CpuScope scope(profile_pick_);
+		StartPick();
+	}
 
 	// if Solid color mesh render is semi-transparent, then we need to render everything twice
 	// basically it works like this:
@@ -586,6 +1224,8 @@ void Renderer::Render() {
 	//} else {
 	for (unsigned i = 0; i < Render::N_RENDER_MODES; ++i) {
 		if (active[i] && shader[i]) {
+			Profiler::CpuScope cpu_scope(profile_render_[i]);
+			Profiler::GpuScope gpu_scope(profile_render_[i]);
 			if (normal_lines) {
 				shader[i]->SetUniform("flip_lines", false);
 				shader[i]->Render();
@@ -597,6 +1237,48 @@ void Renderer::Render() {
 		}
 	}
 	//}
+	Profiler::Instance().EndFrame();
+}
+
+void Renderer::RequestRedraw() {
+	redraw_requested_ = true;
+	glfwPostEmptyEvent();
+}
+
+bool Renderer::NeedsRedraw() {
+	if (redraw_requested_.exchange(false)) return true;
+	// buffers are not updated while the mesh is being changed, a task will ask
+	// for a frame when it is done
+	if (!cmesh().render_ready) return false;
+	// a pick still running asks for a frame when it is done
+	if (!updated_geometry_ || (pick_pending_ && !pick_task_.valid())) return true;
+	{
+		std::lock_guard<std::mutex> lock(dirty_mutex_);
+		if (!dirty_vertices_.empty()) return true;
+	}
+	// shaders are only updated when there is something to draw
+	if (cmesh().n_vertices() == 0) return false;
+	for (int i = 0; i < Render::N_RENDER_MODES; ++i) {
+		if (shader[i] && active[i] && !shader[i]->Updated()) return true;
+	}
+	return false;
+}
+
+void Renderer::UploadFrameData() {
+	FrameData data;
+	data.model_view_proj = modelViewProj;
+	data.model_view = modelView;
+	const glm::mat3 view3(view);
+	for (int i = 0; i < 3; ++i) {
+		data.normal_matrix[i] = glm::vec4(normalmatrix[i], 0.0f);
+		data.view_matrix[i] = glm::vec4(view3[i], 0.0f);
+	}
+	data.lights[0] = glm::vec4(l0Position, l0Intensity);
+	data.lights[1] = glm::vec4(l1Position, l1Intensity);
+	data.lights[2] = glm::vec4(l2Position, l2Intensity);
+	glBindBuffer(GL_UNIFORM_BUFFER, frame_data_buffer_);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 void Renderer::cursorpos_callback(GLFWwindow* win, double x, double y) {
@@ -620,71 +1302,186 @@ void Renderer::cursorpos_callback(GLFWwindow* win, double x, double y) {
 		translate_ += translate_speed_ * look * (-diff.y);
 		translate_start_ = curr;
 	} else if (active[PickerVertex] || active[PickerEdge] || active[PickerFace]) {
-		// line selection mode
-		int vp[4];
-		glGetIntegerv(GL_VIEWPORT, vp);
-		glm::uvec4 viewport(vp[0], vp[1], vp[2], vp[3]);
-		glm::vec3 rayO = glm::unProject({ x, height - y, 0 }, modelView, projection, viewport);
-		glm::vec3 rayD = glm::unProject({ x, height - y, 1 }, modelView, projection, viewport);
-		glm::vec3 ray = rayD - rayO;
-		Vec3d rayOrigin(rayO[0], rayO[1], rayO[2]);
-		Vec3d rayDirection(ray[0], ray[1], ray[2]);
-
-		{ // edge picker
-			double bestDistance = 100000000000.0;
-			EdgeHandle new_selected_edge;
-			for (const EdgeHandle e : cmesh().edges()) {
-				double distance = RayEdgeDist(rayOrigin, rayDirection, e);
-				//glm::vec3 proj = glm::project({ mid[0], mid[1], mid[2] }, modelView, projection, viewport);
-				//distance to camera is proj.z
-				double c = Utils::CosAngleBetween(rayDirection, cmesh().normal(e));
-				// get closer to the ray
-				if (c < 0 && distance < bestDistance) {
-					bestDistance = distance;
-					new_selected_edge = e;
-				}
-			}
-			if (new_selected_edge.is_valid() && new_selected_edge != picked_edge) {
-				picked_edge = new_selected_edge;
-				GetShader(PickerEdge)->Invalidate();
-			}
-		}
+		// only the latest position is evaluated, once per frame in Render
+		pick_pending_ = true;
+		pick_x_ = x;
+		pick_y_ = y;
+	}
+}
 
-		{ // vertex picker
-			double bestDistance = 100000000000.0;
-			VertexHandle new_selected_vertex;
-			for (const VertexHandle v : cmesh().vertices()) {
-				double distance = RayVertexDist(rayOrigin, rayDirection, v);
-				double c = Utils::CosAngleBetween(rayDirection, cmesh().normal(v));
-				if (c < 0 && distance < bestDistance) {
-					bestDistance = distance;
-					new_selected_vertex = v;
-				}
-			}
-			if (new_selected_vertex.is_valid() && new_selected_vertex != picked_vertex) {
-				picked_vertex = new_selected_vertex;
-				GetShader(PickerVertex)->Invalidate();
-			}
+void Renderer::StartPick() {
+	// the pick still running keeps this one pending, so once it is done
+	// only the last cursor position is picked
+	if (!gpu_picking && pick_task_.valid()) return;
+	TRACE_FUNCTION();
+	pick_pending_ = false;
+	int vp[4];
+	glGetIntegerv(GL_VIEWPORT, vp);
+	glm::uvec4 viewport(vp[0], vp[1], vp[2], vp[3]);
+
+	// keep the previous pick when there is nothing under the cursor
+	if (gpu_picking) {
+		const int px = (int)std::floor(pick_x_);
+		const int py = height - 1 - (int)std::floor(pick_y_);
+		FaceHandle face;
+		float depth;
+		if (!PickGPU(px, py, face, depth)) return;
+		const glm::vec3 p = glm::unProject({ px + 0.5f, py + 0.5f, depth }, modelView, projection, viewport);
+		ApplyPick(ResolvePick(face, Vec3d(p[0], p[1], p[2])));
+		return;
+	}
+
+	// the mesh may have been replaced since the last upload
+	if (!bvh_ || bvh_->NumFaces() != cmesh().n_faces() || bvh_->NumVertices() != cmesh().n_vertices()) return;
+	glm::vec3 rayO = glm::unProject({ pick_x_, height - pick_y_, 0 }, modelView, projection, viewport);
+	glm::vec3 rayD = glm::unProject({ pick_x_, height - pick_y_, 1 }, modelView, projection, viewport);
+	glm::vec3 ray = rayD - rayO;
+	Vec3d rayOrigin(rayO[0], rayO[1], rayO[2]);
+	Vec3d rayDirection(ray[0], ray[1], ray[2]);
+
+	// the result is applied in the next frame. The hierarchy only changes on 
+	// this thread after that, so the task can read it without locking
+	std::shared_ptr<const FaceBVH> bvh = bvh_;
+	std::lock_guard<std::mutex> lock(mesh_tasks_mutex_);
+	if (!cmesh().render_ready) return;
+	pick_task_ = Worker::Submit([bvh, rayOrigin, rayDirection]() {
+		const FaceBVH::Hit hit = bvh->Intersect(cmesh(), rayOrigin, rayDirection);
+		if (!hit.face.is_valid()) return PickResult();
+		return ResolvePick(hit.face, hit.point);
+	}, {}, "Pick", Priority::High);
+}
+
+void Renderer::FinishPick() {
+	// never blocks the frame, the task asks for another one when it is done
+	if (!pick_task_.valid() || !pick_task_.Handle()->Finished()) return;
+	TRACE_FUNCTION();
+	if (pick_task_.Handle()->GetState() == Task::Done && !pick_task_.Handle()->CancelRequested()) {
+		ApplyPick(pick_task_.get());
+	}
+	std::lock_guard<std::mutex> lock(mesh_tasks_mutex_);
+	pick_task_ = TaskFuture<PickResult>();
+}
+
+void Renderer::StopMeshTasks() {
+	std::vector<TaskHandle> tasks;
+	{
+		std::lock_guard<std::mutex> lock(mesh_tasks_mutex_);
+		tasks.push_back(bvh_build_.Handle());
+		tasks.push_back(pick_task_.Handle());
+	}
+	for (const TaskHandle& task : tasks) {
+		if (!task) continue;
+		task->Cancel();
+		Worker::Wait(task);
+	}
+}
+
+void Renderer::SetFeatureMaxAngle(float degrees) {
+	// the mesh cannot be replaced while the lock is held, StopMeshTasks waits for it
+	std::lock_guard<std::mutex> lock(mesh_tasks_mutex_);
+	if (!cmesh().render_ready) return;
+	std::vector<EdgeHandle> changed;
+	if (mesh().set_feature_max_angle(degrees, changed))
+		GetEdgeShader(FeaturesEdges)->Invalidate(changed);
+	else
+		GetShader(FeaturesEdges)->Invalidate();
+}
+
+Renderer::PickResult Renderer::ResolvePick(const FaceHandle face, const Vec3d& point) {
+	// the picked vertex and edge are the ones of the face closest to the point
+	PickResult pick;
+	pick.face = face;
+	double best_vertex = std::numeric_limits<double>::infinity();
+	double best_edge = std::numeric_limits<double>::infinity();
+	for (const HalfedgeHandle he : cmesh().fh_range(face)) {
+		const Vec3d to = cmesh().point(cmesh().to_vertex_handle(he));
+		const Vec3d from = cmesh().point(cmesh().from_vertex_handle(he));
+		const double vertex_distance = (to - point).norm();
+		if (vertex_distance < best_vertex) {
+			best_vertex = vertex_distance;
+			pick.vertex = cmesh().to_vertex_handle(he);
 		}
+		const double edge_distance = PointSegmentDist(point, from, to);
+		if (edge_distance < best_edge) {
+			best_edge = edge_distance;
+			pick.edge = cmesh().edge_handle(he);
+		}
+	}
+	return pick;
+}
 
-		{ // face picker
-			// I'm lazy so I just use distance to center of the face
-			double bestDistance = 100000000000.0;
-			FaceHandle new_selected_face;
-			for (const FaceHandle f : cmesh().faces()) {
-				double distance = RayPointDist(rayOrigin, rayDirection, cmesh().midpoint(f));
-				double c = Utils::CosAngleBetween(rayDirection, cmesh().normal(f));
-				if (c < 0 && distance < bestDistance) {
-					bestDistance = distance;
-					new_selected_face = f;
-				}
-			}
-			if (new_selected_face.is_valid() && new_selected_face != picked_vertex) {
-				picked_face = new_selected_face;
-				GetShader(PickerFace)->Invalidate();
-			}
+void Renderer::ApplyPick(const PickResult& pick) {
+	if (!pick.face.is_valid()) return;
+	if (pick.edge != picked_edge) {
+		picked_edge = pick.edge;
+		GetShader(PickerEdge)->Invalidate();
+	}
+	if (pick.vertex != picked_vertex) {
+		picked_vertex = pick.vertex;
+		GetShader(PickerVertex)->Invalidate();
+	}
+	if (pick.face != picked_face) {
+		picked_face = pick.face;
+		GetShader(PickerFace)->Invalidate();
+	}
+}
+
+bool Renderer::PickGPU(const int px, const int py, FaceHandle& face, float& depth) {
+	if (px < 0 || py < 0 || px >= width || py >= height) return false;
+	if (face_triangle_offset_.empty() || !id_shader_->HasAttrib("position")) return false;
+
+	if (pick_width_ != width || pick_height_ != height) {
+		if (!pick_framebuffer_) {
+			glGenFramebuffers(1, &pick_framebuffer_);
+			glGenRenderbuffers(1, &pick_id_buffer_);
+			glGenRenderbuffers(1, &pick_depth_buffer_);
 		}
+		glBindRenderbuffer(GL_RENDERBUFFER, pick_id_buffer_);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_R32UI, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, pick_depth_buffer_);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, pick_framebuffer_);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, pick_id_buffer_);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, pick_depth_buffer_);
+		const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			print(LogLevel::Error, "Picking framebuffer incomplete: 0x%x, GPU picking disabled\n", status);
+			gpu_picking = false;
+			return false;
+		}
+		pick_width_ = width;
+		pick_height_ = height;
 	}
+
+	// only the pixel under the cursor is rasterized
+	glBindFramebuffer(GL_FRAMEBUFFER, pick_framebuffer_);
+	glViewport(0, 0, width, height);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(px, py, 1, 1);
+	const GLuint background[4] = { 0, 0, 0, 0 };
+	glClearBufferuiv(GL_COLOR, 0, background);
+	glDepthMask(GL_TRUE);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+
+	id_shader_->Bind();
+	id_shader_->DrawArray();
+
+	GLuint id = 0;
+	glReadPixels(px, py, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, &id);
+	glReadPixels(px, py, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &depth);
+	glDisable(GL_SCISSOR_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (id == 0) return false;
+
+	// id is the triangle in the soup + 1, find the face it belongs to
+	const GLuint triangle = id - 1;
+	if (triangle >= face_triangle_offset_.back()) return false;
+	const auto it = std::upper_bound(face_triangle_offset_.begin(), face_triangle_offset_.end(), triangle);
+	face = FaceHandle((int)(it - face_triangle_offset_.begin()) - 1);
+	return true;
 }
 
 void Renderer::mouseButton_callback(GLFWwindow* win, int button, int action, int modifiers) {
@@ -741,17 +1538,25 @@ void Renderer::ResetCamera() {
 	scale_ = 4.0f;
 }
 
+void Renderer::UpdateColorFormat() {
+	for (int i = 0; i < Render::N_RENDER_MODES; ++i) {
+		if (shader[i]) {
+			shader[i]->SetRgba8Colors(rgba8_colors);
+		}
+	}
+}
+
 void Renderer::SetSolidColor() {
-	face_shader[Solid]->SetColorFunc(
-		[this](const FaceHandle, const VertexHandle) {
-		return Converters::convert(solidcolor);
+	const Eigen::Vector4f color = Converters::convert(solidcolor);
+	face_shader[Solid]->SetColors([color](Eigen::Matrix4Xf& colors) {
+		colors.colwise() = color;
 	});
 }
 
 void Renderer::SetWireframeColor() {
-	edge_shader[Wireframe]->SetColorFunc(
-		[&](EdgeHandle, unsigned int) -> Color {
-		return Converters::convert(wirecolor);
+	const Eigen::Vector4f color = Converters::convert(wirecolor);
+	edge_shader[Wireframe]->SetColors([color](Eigen::Matrix4Xf& colors) {
+		colors.colwise() = color;
 	});
 }
 
@@ -797,6 +1602,12 @@ void Renderer::DrawInterface(bool *p_open) {
 		ImGui::DragFloat3("SpecularMaterial", glm::value_ptr(SpecularMaterial), 0.01f, 0.0f, 1.0f);
 		ImGui::TreePop();
 	}
+	if (ImGui::Checkbox("Indexed", &indexed_shading)) InvalidateGeometry();
+	if (ImGui::IsItemHovered()) ImGui::SetTooltip("Share vertices between faces, split only at feature edges");
+	if (ImGui::Checkbox("16-bit Positions", &quantized_positions)) InvalidateGeometry();
+	if (ImGui::IsItemHovered()) ImGui::SetTooltip("Quantize positions in the bounding box, 6 bytes instead of 12");
+	if (ImGui::Checkbox("Octahedral Normals", &octahedral_normals)) InvalidateGeometry();
+	if (ImGui::IsItemHovered()) ImGui::SetTooltip("Normals as two 16-bit numbers, 4 bytes instead of 12");
 	ImGui::Checkbox("Mesh: Solid", &active[Solid]);
 	ImGui::SameLine();
 	ImGui::ColorButton("", solidcolor);
@@ -888,6 +1699,10 @@ void Renderer::DrawInterface(bool *p_open) {
 	ImGui::Checkbox("Picker (Vertex)", &active[PickerVertex]);
 	ImGui::Checkbox("Picker (Edge)", &active[PickerEdge]);
 	ImGui::Checkbox("Picker (Face)", &active[PickerFace]);
+	ImGui::Checkbox("GPU Picking", &gpu_picking);
+	if (ImGui::Checkbox("8-bit Colors", &rgba8_colors)) {
+		UpdateColorFormat();
+	}
 	ImGui::Separator();
 	ImGui::Checkbox("Vertex Normals", &active[VertexNormals]);
 	ImGui::Checkbox("Edge Normals", &active[EdgeNormals]);
@@ -899,6 +1714,19 @@ void Renderer::DrawInterface(bool *p_open) {
 		InvalidateGeometry();
 	}
 	if (ImGui::IsItemHovered()) ImGui::SetTooltip("Force refresh everything");
+	if (ImGui::Button("Benchmark Upload", ImVec2(150, 0))) {
+		BenchmarkUpload();
+	}
+	if (ImGui::IsItemHovered()) ImGui::SetTooltip("Time the mesh upload with 1, 2, 4... threads");
+	if (ImGui::Button("Benchmark Edges", ImVec2(150, 0))) {
+		BenchmarkEdgeDraw();
+	}
+	if (ImGui::Button("Benchmark Colors", ImVec2(150, 0))) {
+		BenchmarkColors();
+	}
+	if (ImGui::Button("Benchmark Frame", ImVec2(150, 0))) {
+		BenchmarkFrame();
+	}
 	ImGui::End();
 }
 
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <vector>
 
 #include <glm\glm.hpp>
@@ -17,6 +19,9 @@
 #include "MyMesh.h"
 #include "CommonDefs.h"
 #include "MyShader.h"
+#include "Worker.h"
+
+class FaceBVH;
 
 class Renderer {
 public:
@@ -39,8 +44,22 @@ public:
 	void DrawCameraInterface(bool* p_open = nullptr);
 
 	// Causes renderer to upload the geometry in the next frame
-	void InvalidateGeometry() { updated_geometry_ = false; }
+	void InvalidateGeometry() { 
+		updated_geometry_ = false; 
+		RequestRedraw();
+	}
+	// Causes renderer to upload only the vertices in [begin, end), and the normals around 
+	// them, in the next frame. For when vertices moved but the topology is the same. 
+	// Safe to call from any thread
+	void InvalidatePositions(size_t begin, size_t end);
+	void InvalidatePositions() { InvalidatePositions(0, cmesh().n_vertices()); }
 	void InvalidateChainTypes();
+	// Cancels the background tasks reading the mesh and waits for them. Call it
+	// after clearing render_ready and before replacing the mesh. Safe to call from any thread
+	void StopMeshTasks();
+	// Changes the feature angle of the mesh and updates the feature edges. Ignored
+	// while the mesh is being replaced. Call it from the render thread
+	void SetFeatureMaxAngle(float degrees);
 
 	template<typename Matrix>
 	void UploadShaderAttrib(enum Render mode, std::string name, Matrix& M) {
@@ -50,6 +69,13 @@ public:
 
 	void Render();
 
+	// Asks for a new frame when redrawing on demand, waking up the main loop.
+	// Safe to call from any thread
+	void RequestRedraw();
+	// True if a frame was requested or something changed since the last one: 
+	// buffers or active shaders invalidated, moved vertices. Clears the request
+	bool NeedsRedraw();
+
 	void ResetCamera();
 
 	int Width() const { return width; }
@@ -61,6 +87,8 @@ public:
 	CustomShader* GetCustomShader(enum Render mode) { return custom_shader[mode]; }
 	HalfedgeShader* GetHalfedgeShader(enum Render mode) { return halfedge_shader[mode]; }
 
+	// applies rgba8_colors to all the shaders
+	void UpdateColorFormat();
 	void SetSolidColor();
 	void SetWireframeColor();
 	void SetFeatureColor();
@@ -84,6 +112,21 @@ public:
 	float wire_thickness_factor = 0.125f;
 	float line_thickness_factor = 0.15f;
 
+	// Shaded mode shares vertices between faces instead of using a triangle soup
+	bool indexed_shading = true;
+
+	// picking reads the face under the cursor from an offscreen id buffer instead of
+	// intersecting the BVH
+	bool gpu_picking = false;
+
+	// colors are uploaded as normalized bytes instead of floats
+	bool rgba8_colors = true;
+
+	// vertex format of the next full upload: positions as 16-bit integers in the 
+	// bounding box, normals as two 16-bit octahedral coordinates
+	bool quantized_positions = false;
+	bool octahedral_normals = false;
+
 	bool normal_lines = true;
 	bool flipped_lines = false;
 
@@ -95,8 +138,50 @@ public:
 	glm::vec3 rotation_center = glm::vec3(0.0f, 0.0f, 0.0f);
 	glm::vec3 rotation_axis = glm::vec3(0.0f, 1.0f, 0.0f);
 private:
-	void UploadMeshData();
+	// builds all the geometry buffers in parallel and uploads them
+	void UploadMeshData(bool report = true);
+	void BuildShadedIndexed(Eigen::Matrix3Xf& positions, Eigen::Matrix3Xf& normals,
+		Eigen::Matrix<uint32_t, 3, Eigen::Dynamic>& indices);
+	// prints the upload time for an increasing number of threads
+	void BenchmarkUpload();
+	// prints the draw time of the boundary and feature edges, with and without
+	// skipping the hidden ones
+	void BenchmarkEdgeDraw();
+	// prints the time to update the Solid and Wireframe colors with a function
+	// per element and with the bulk color APIs
+	void BenchmarkColors();
+	// prints the CPU time of Render(), without waiting for the GPU
+	void BenchmarkFrame();
+	// fills the FrameData uniform buffer from the current matrices and lights
+	void UploadFrameData();
+	// uploads the moved vertices and what depends on them. Returns false
+	// if a full upload is needed instead
+	bool UpdatePositions(const std::vector<std::pair<size_t, size_t>>& moved_ranges);
 	void UpdateLineThickness();
+	// latches the vertex format options for a full upload and sets the shader uniforms,
+	// which shaders/common.glsl decodes
+	void SetVertexFormat();
+	// upload positions or normals in the current vertex format, the shader must be
+	// bound. The range versions of positions return false if one is out of the 
+	// quantization box
+	void UploadPositions(enum Render mode, const Eigen::Matrix3Xf& positions);
+	bool UploadPositionsRange(enum Render mode, const Eigen::Matrix3Xf& positions, uint32_t first);
+	void UploadNormals(enum Render mode, const Eigen::Matrix3Xf& normals);
+	void UploadNormalsRange(enum Render mode, const Eigen::Matrix3Xf& normals, uint32_t first);
+	struct PickResult {
+		FaceHandle face; // invalid if nothing was hit
+		VertexHandle vertex;
+		EdgeHandle edge;
+	};
+	// picks at the last cursor position. With the BVH it runs on the thread pool,
+	// one pick at a time, and FinishPick applies the result once it is done
+	void StartPick();
+	void FinishPick();
+	// face, and its vertex and edge closest to point
+	static PickResult ResolvePick(FaceHandle face, const Vec3d& point);
+	void ApplyPick(const PickResult& pick);
+	// renders triangle ids at pixel (px, py), bottom-up. Returns false on background
+	bool PickGPU(int px, int py, FaceHandle& face, float& depth);
 
 	// returns screen coords in range [-1, 1], [-1, 1]
 	glm::vec2 GetScreenCoords(double x, double y) const {
@@ -151,16 +236,94 @@ private:
 	glm::mat4 modelView;
 	glm::mat3 normalmatrix;
 
+	// per-frame uniform block shared by all the shaders, declared in 
+	// shaders/common.glsl in std140 layout. mat3 columns take a vec4 each, so 
+	// they are stored padded
+	struct FrameData {
+		glm::mat4 model_view_proj;   // offset 0
+		glm::mat4 model_view;        // 64
+		glm::vec4 normal_matrix[3];  // 128
+		glm::vec4 view_matrix[3];    // 176
+		glm::vec4 lights[3];         // 224, xyz position, w intensity
+	};
+	static_assert(sizeof(FrameData) == 272, "FrameData must match the std140 layout");
+	GLuint frame_data_buffer_ = 0;
+
+	// Profiler sections
+	int profile_upload_;
+	int profile_positions_;
+	int profile_pick_;
+	int profile_update_[Render::N_RENDER_MODES];
+	int profile_render_[Render::N_RENDER_MODES];
+
 	BasicShader* shader[Render::N_RENDER_MODES];
 	FaceShader* face_shader[Render::N_RENDER_MODES];
 	EdgeShader* edge_shader[Render::N_RENDER_MODES];
 	CustomShader* custom_shader[Render::N_RENDER_MODES];
 	HalfedgeShader* halfedge_shader[Render::N_RENDER_MODES];
+	SparseShader* sparse_shader[Render::N_RENDER_MODES];
 
 	std::vector<enum Render> face_shader_list;
 	std::vector<enum Render> edge_shader_list;
 	std::vector<enum Render> halfedge_shader_list;
 	std::vector<enum Render> normal_shader_list;
+	std::vector<enum Render> sparse_shader_list;
 
 	bool updated_geometry_;
+	std::atomic<bool> redraw_requested_;
+	// time spent by the last UploadMeshData, in seconds
+	double upload_build_time_ = 0.0;
+	double upload_gl_time_ = 0.0;
+
+	// vertex ranges moved since the last frame, see InvalidatePositions
+	std::mutex dirty_mutex_;
+	std::vector<std::pair<size_t, size_t>> dirty_vertices_;
+
+	// what the uploaded buffers were built from, reused when only positions change
+	size_t uploaded_vertices_ = 0;
+	size_t uploaded_faces_ = 0;
+	size_t uploaded_edges_ = 0;
+	double normal_length_factor_ = 0.0;
+	// vertex format of the uploaded buffers, see SetVertexFormat
+	bool quantized_positions_ = false;
+	bool octahedral_normals_ = false;
+	Vector3f position_offset_;
+	Vector3f position_scale_;
+	// largest errors measured in the last full upload, normals in radians
+	float position_error_ = 0.0f;
+	float normal_error_ = 0.0f;
+	// the triangles of face f are [face_triangle_offset_[f], face_triangle_offset_[f + 1])
+	std::vector<GLuint> face_triangle_offset_;
+
+	// picking hierarchy, rebuilt in the background on full uploads and refit when 
+	// only positions change. Only used from the render thread
+	std::shared_ptr<FaceBVH> bvh_;
+	// taken to start or clear bvh_build_ and pick_task_, to change the feature
+	// angle, and by StopMeshTasks
+	std::mutex mesh_tasks_mutex_;
+	TaskFuture<std::shared_ptr<FaceBVH>> bvh_build_;
+	bool bvh_refit_pending_ = false;
+
+	// cursor position to pick at, evaluated once per frame
+	bool pick_pending_ = false;
+	double pick_x_ = 0.0;
+	double pick_y_ = 0.0;
+	TaskFuture<PickResult> pick_task_;
+
+	// id buffer for gpu_picking, reallocated when the window size changes
+	BasicShader* id_shader_ = nullptr;
+	GLuint pick_framebuffer_ = 0;
+	GLuint pick_id_buffer_ = 0;
+	GLuint pick_depth_buffer_ = 0;
+	int pick_width_ = 0;
+	int pick_height_ = 0;
+
+	// indexed Shaded mode data: the split copies of vertex v are 
+	// [vertex_split_offset_[v], vertex_split_offset_[v + 1]), and 
+	// corner_split_[he] is the copy of to_vertex(he) used by face(he)
+	bool shaded_indexed_ = false;
+	std::vector<uint32_t> vertex_split_offset_;
+	std::vector<uint32_t> corner_split_;
+	// a face using each copy, to recompute its normal
+	std::vector<FaceHandle> split_face_;
 };
@@ -0,0 +1,138 @@
+#include "Trace.h"
+
+#include <fstream>
+#include <unordered_set>
+#include <stdio.h>
+
+struct Trace::Registry {
+	std::mutex mutex;
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers; // kept after their thread exits
+	std::unordered_set<std::string> names; // elements do not move
+};
+
+namespace {
+	// names are written between quotes
+	void WriteEscaped(std::ostream& out, const char* text) {
+		for (const char* c = text; *c; ++c) {
+			switch (*c) {
+			case '"': out << "\\\""; break;
+			case '\\': out << "\\\\"; break;
+			case '\n': out << "\\n"; break;
+			default:
+				if ((unsigned char)*c < 0x20) {
+					char code[8];
+					snprintf(code, sizeof(code), "\\u%04x", *c);
+					out << code;
+				} else {
+					out << *c;
+				}
+			}
+		}
+	}
+}
+
+std::atomic<bool> Trace::enabled(false);
+const std::chrono::steady_clock::time_point Trace::start_time = std::chrono::steady_clock::now();
+
+Trace::Registry& Trace::GetRegistry() {
+	static Registry registry;
+	return registry;
+}
+
+Trace::ThreadBuffer& Trace::Local() {
+	thread_local std::shared_ptr<ThreadBuffer> local;
+	if (!local) {
+		local = std::make_shared<ThreadBuffer>();
+		local->events.reserve(thread_capacity);
+		Registry& registry = GetRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		local->id = (int)registry.buffers.size();
+		local->name = "Thread " + std::to_string(local->id);
+		registry.buffers.push_back(local);
+	}
+	return *local;
+}
+
+void Trace::Record(const char* name, int64_t start, int64_t end) {
+	ThreadBuffer& buffer = Local();
+	const Event event = { name, start, end };
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	if (buffer.events.size() < thread_capacity) {
+		buffer.events.push_back(event);
+	} else {
+		buffer.events[buffer.count % thread_capacity] = event;
+	}
+	++buffer.count;
+}
+
+void Trace::SetThreadName(const std::string& name) {
+	ThreadBuffer& buffer = Local();
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	buffer.name = name;
+}
+
+const char* Trace::Intern(const std::string& name) {
+	Registry& registry = GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	return registry.names.insert(name).first->c_str();
+}
+
+void Trace::Clear() {
+	Registry& registry = GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	for (const auto& buffer : registry.buffers) {
+		std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+		buffer->events.clear();
+		buffer->count = 0;
+	}
+}
+
+size_t Trace::EventCount() {
+	Registry& registry = GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	size_t count = 0;
+	for (const auto& buffer : registry.buffers) {
+		std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+		count += buffer->events.size();
+	}
+	return count;
+}
+
+bool Trace::ExportJSON(const std::string& filename) {
+	// copy the events first, so recording threads wait as little as possible
+	struct ThreadEvents {
+		std::string name;
+		int id;
+		std::vector<Event> events;
+	};
+	std::vector<ThreadEvents> threads;
+	{
+		Registry& registry = GetRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (const auto& buffer : registry.buffers) {
+			std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+			threads.push_back({ buffer->name, buffer->id, buffer->events });
+		}
+	}
+
+	std::ofstream file(filename);
+	if (!file) return false;
+	file << "{\"traceEvents\":[\n";
+	bool first = true;
+	for (const ThreadEvents& thread : threads) {
+		file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+			<< thread.id << ",\"args\":{\"name\":\"";
+		WriteEscaped(file, thread.name.c_str());
+		file << "\"}}";
+		first = false;
+		// complete events, the viewer nests them by time
+		for (const Event& event : thread.events) {
+			file << ",\n{\"name\":\"";
+			WriteEscaped(file, event.name);
+			file << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread.id
+				<< ",\"ts\":" << event.start << ",\"dur\":" << event.end - event.start << "}";
+		}
+	}
+	file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+	return (bool)file;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+// Build with SKETCHER_TRACING=0 to compile the trace scopes out
+#ifndef SKETCHER_TRACING
+#define SKETCHER_TRACING 1
+#endif
+
+// Timeline of scopes on every thread, exported as Chrome trace JSON (open it
+// in chrome://tracing or ui.perfetto.dev). Every thread records to its own
+// buffer, keeping the last events, so recording does not contend with other
+// threads. Use the TRACE_SCOPE macros rather than Trace::Scope directly.
+class Trace {
+public:
+	// Records the time between construction and destruction. The name must
+	// live until the trace is exported: a literal, or a name from Intern
+	class Scope {
+	public:
+		explicit Scope(const char* name)
+			: name_(Trace::enabled ? name : nullptr), start_(name_ ? Now() : 0) {}
+		~Scope() { if (name_) Record(name_, start_, Now()); }
+	private:
+		const char* name_;
+		int64_t start_;
+	};
+
+	// Name of the calling thread in the timeline
+	static void SetThreadName(const std::string& name);
+	// Copy of the name kept until exit, for names that are not literals
+	static const char* Intern(const std::string& name);
+
+	// writes the events of every thread as {"traceEvents": [...]}
+	static bool ExportJSON(const std::string& filename);
+	static void Clear();
+	// events currently kept, of every thread
+	static size_t EventCount();
+
+	// checked when a scope begins, off until the Trace checkbox in Controls
+	static std::atomic<bool> enabled;
+
+	// events kept per thread, older ones are overwritten
+	enum { thread_capacity = 1 << 16 };
+
+private:
+	struct Event {
+		const char* name;
+		int64_t start; // microseconds since startup
+		int64_t end;
+	};
+
+	struct ThreadBuffer {
+		std::mutex mutex; // only contended while exporting
+		std::string name;
+		int id;
+		std::vector<Event> events; // ring of thread_capacity
+		size_t count = 0; // ever recorded
+	};
+
+	static int64_t Now() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start_time).count();
+	}
+	static void Record(const char* name, int64_t start, int64_t end);
+	// buffer of the calling thread, registered on first use
+	static ThreadBuffer& Local();
+
+	// buffers of every thread and the interned names
+	struct Registry;
+	static Registry& GetRegistry();
+
+	static const std::chrono::steady_clock::time_point start_time;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#if SKETCHER_TRACING
+// Times the rest of the enclosing scope
+#define TRACE_SCOPE(name) Trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_FUNCTION() TRACE_SCOPE(__FUNCTION__)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_FUNCTION() ((void)0)
+#endif
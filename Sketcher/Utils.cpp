@@ -60,6 +60,19 @@ Vector3d Utils::RotateOnPlane(const Vector3d& v,
 	return Vector3d(1.0, 0.0, 0.0);
 }
 
+std::vector<std::pair<size_t, size_t>> Utils::Ranges(std::vector<size_t> indices, size_t max_gap) {
+	std::vector<std::pair<size_t, size_t>> ranges;
+	std::sort(indices.begin(), indices.end());
+	for (const size_t i : indices) {
+		if (!ranges.empty() && i <= ranges.back().second + max_gap) {
+			ranges.back().second = std::max(ranges.back().second, i + 1);
+		} else {
+			ranges.push_back(std::make_pair(i, i + 1));
+		}
+	}
+	return ranges;
+}
+
 double Utils::Get90thPerc(std::vector<double>& vector) {
 	return GetXthPerc(vector, percentile);
 }
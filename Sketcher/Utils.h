@@ -40,6 +40,11 @@ public:
 	// Assumes that n is normalized
 	static Vector3d RotateOnPlane(const Vector3d& v, const Vector3d& n, const Vector3d& axis);
 
+	// Sorts the indices and groups them in [begin, end) ranges. Indices less than
+	// max_gap apart end up in the same range, as one bigger range is usually
+	// cheaper than many small ones (e.g. for glBufferSubData)
+	static std::vector<std::pair<size_t, size_t>> Ranges(std::vector<size_t> indices, size_t max_gap);
+
 	static double GetXthPerc(std::vector<double>& v, double perc);
 	static double Get90thPerc(std::vector<double>& v);
 
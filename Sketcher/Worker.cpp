@@ -1,25 +1,487 @@
 #include "Worker.h"
+#include "Trace.h"
+#include "Log.h"
 
-bool Worker::Do(std::function<void()> task) {
-	if (Instance().should_stop) return false;
-	Instance().tasks.push(task);
+#include <algorithm>
+#include <chrono>
+#include <exception>
+
+namespace {
+	// task run by this thread, if any
+	thread_local Task* current_task = nullptr;
+
+	// index of the pool queue owned by this thread, -1 if not a pool thread
+	thread_local int pool_index = -1;
+
+	// smallest amount of elements worth sending to another thread
+	const size_t min_chunk_size = 512;
+	// chunks per thread, more chunks balance better when some are slower
+	const size_t chunks_per_thread = 4;
+
+	// name of the task in the trace. Interning takes a lock, so it is done
+	// once per task rather than every time one runs
+	const char* TraceName(const std::string& name) {
+		return name.empty() ? "Task" : Trace::Intern(name);
+	}
+
+	typedef std::chrono::steady_clock Clock;
+
+	double Microseconds(Clock::duration duration) {
+		return std::chrono::duration<double, std::micro>(duration).count();
+	}
+
+	// prints the latency and throughput of the tasks created by
+	// enqueue(std::function<void()>), which returns their handle
+	template <typename Enqueue>
+	void BenchmarkTasks(const char* name, const Enqueue& enqueue) {
+		// one task at a time, so none waits behind another
+		const int latency_runs = 1000;
+		std::vector<double> latency(latency_runs);
+		for (int i = 0; i < latency_runs; ++i) {
+			std::atomic<bool> started(false);
+			Clock::time_point start;
+			const Clock::time_point enqueued = Clock::now();
+			const TaskHandle task = enqueue([&]() { start = Clock::now(); started = true; });
+			// Wait would run a ready submitted task on this thread instead
+			while (!started) std::this_thread::yield();
+			Worker::Wait(task);
+			latency[i] = Microseconds(start - enqueued);
+		}
+		std::sort(latency.begin(), latency.end());
+
+		// empty tasks enqueued all at once
+		const int throughput_runs = 100000;
+		std::atomic<int> done(0);
+		const Clock::time_point begin = Clock::now();
+		for (int i = 0; i < throughput_runs; ++i) {
+			enqueue([&done]() { ++done; });
+		}
+		while (done < throughput_runs) std::this_thread::yield();
+		const double seconds = Microseconds(Clock::now() - begin) / 1e6;
+
+		print("%-6s start latency median %5.1f us, 99%% %6.1f us, %7.0f tasks/s\n", name,
+			latency[latency_runs / 2], latency[latency_runs * 99 / 100], throughput_runs / seconds);
+	}
+}
+
+TaskHandle Worker::Do(std::function<void()> task, Priority priority, const std::string& name) {
+	Worker& worker = Instance();
+	const char* trace_name = TraceName(name);
+	TaskHandle handle;
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		if (worker.should_stop) return nullptr;
+		handle.reset(new Task(std::move(task), priority, name, trace_name, worker.n_submitted++));
+		worker.tasks.push(handle);
+		++worker.n_unfinished;
+	}
+	worker.wakeup.notify_one();
+	return handle;
+}
+
+TaskHandle Worker::SubmitTask(std::function<void()> run,
+	const std::vector<TaskHandle>& after, const std::string& name, Priority priority) {
+	Worker& worker = Instance();
+	const char* trace_name = TraceName(name);
+	TaskHandle task;
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		task.reset(new Task(std::move(run), priority, name, trace_name, worker.n_submitted++));
+		++worker.n_unfinished;
+	}
+	{
+		// the extra count keeps the task from starting until all edges are added
+		std::lock_guard<std::mutex> lock(worker.graph_mutex);
+		task->unmet_dependencies_ = 1;
+		for (const TaskHandle& dependency : after) {
+			if (!dependency) continue;
+			if (dependency->GetState() == Task::Cancelled) task->cancel_ = true;
+			if (dependency->Finished()) continue;
+			dependency->dependents_.push_back(task);
+			++task->unmet_dependencies_;
+		}
+	}
+	if (--task->unmet_dependencies_ == 0) {
+		worker.Schedule(task);
+	}
+	return task;
+}
+
+void Worker::Schedule(const TaskHandle& task) {
+	task->ready_ = true;
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		pool_tasks.push(task);
+	}
+	WakePool();
+}
+
+void Worker::RunTask(const TaskHandle& task) {
+	const bool dropped = task->cancel_;
+	if (!dropped) {
+		task->state_ = Task::Running;
+		Task* previous = current_task; // a waiting task can run another one
+		current_task = task.get();
+		TRACE_SCOPE(task->trace_name_);
+		task->run_();
+		current_task = previous;
+	}
+	task->run_ = nullptr; // release whatever the task captured
+
+	// cancelled while running without checking Worker::Cancelled(), it ran to the end
+	const bool cancelled = dropped || task->cancel_seen_;
+	std::vector<TaskHandle> dependents;
+	std::function<void()> callback;
+	{
+		std::lock_guard<std::mutex> lock(graph_mutex);
+		callback = task_done_callback;
+		if (cancelled) {
+			task->state_ = Task::Cancelled;
+		} else {
+			task->progress_ = 1.0f;
+			task->state_ = Task::Done;
+		}
+		dependents.swap(task->dependents_);
+	}
+	task_done.notify_all();
+
+	for (const TaskHandle& dependent : dependents) {
+		if (cancelled) dependent->cancel_ = true;
+		if (--dependent->unmet_dependencies_ == 0) {
+			Schedule(dependent);
+		}
+	}
+	if (callback) callback();
+	--n_unfinished;
+}
+
+void Worker::Wait(const TaskHandle& task) {
+	if (!task) return;
+	Worker& worker = Instance();
+	while (!task->Finished()) {
+		// its entry in the pool queue is skipped once claimed
+		if (task->ready_ && !task->claimed_.exchange(true)) {
+			worker.RunTask(task);
+			continue;
+		}
+		// becoming ready does not notify task_done, so do not sleep for long
+		std::unique_lock<std::mutex> lock(worker.graph_mutex);
+		worker.task_done.wait_for(lock, std::chrono::milliseconds(1),
+			[&task]() { return task->Finished(); });
+	}
+}
+
+TaskHandle Worker::Running() {
+	Worker& worker = Instance();
+	std::lock_guard<std::mutex> lock(worker.mutex);
+	return worker.running;
+}
+
+bool Worker::Idle() {
+	return Instance().n_unfinished == 0;
+}
+
+size_t Worker::QueueSize() {
+	Worker& worker = Instance();
+	std::lock_guard<std::mutex> lock(worker.mutex);
+	return worker.tasks.size();
+}
+
+void Worker::Benchmark() {
+	if (Running() != nullptr || QueueSize() > 0) {
+		print(LogLevel::Warning, "Task benchmark skipped, wait for the running tasks\n");
+		return;
+	}
+	print("Task benchmark, %lu pool threads\n", (unsigned long)Instance().pool.size());
+	BenchmarkTasks("Do", [](std::function<void()> f) { return Do(std::move(f)); });
+	BenchmarkTasks("Submit", [](std::function<void()> f) { return Submit(std::move(f)).Handle(); });
+}
+
+void Worker::SetTaskDoneCallback(std::function<void()> callback) {
+	Worker& worker = Instance();
+	std::lock_guard<std::mutex> lock(worker.graph_mutex);
+	worker.task_done_callback = std::move(callback);
+}
+
+bool Worker::Cancelled() {
+	if (current_task == nullptr || !current_task->cancel_) return false;
+	current_task->cancel_seen_ = true;
 	return true;
 }
 
+void Worker::SetProgress(float progress) {
+	if (current_task == nullptr) return;
+	current_task->progress_ = std::min(1.0f, std::max(0.0f, progress));
+}
+
 void Worker::Stop() {
-	Instance().should_stop = true; // do not accept more jobs
-	Instance().thread.join();
+	Worker& worker = Instance();
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.should_stop = true; // do not accept more jobs
+	}
+	worker.wakeup.notify_one();
+	if (worker.thread.joinable()) worker.thread.join();
+
+	// parallel loops are blocking, so only submitted tasks can be left, 
+	// and they are dropped
+	{
+		std::lock_guard<std::mutex> lock(worker.pool_mutex);
+		worker.pool_stop = true;
+	}
+	worker.pool_wakeup.notify_all();
+	for (std::thread& t : worker.pool) {
+		if (t.joinable()) t.join();
+	}
 }
 
 Worker::Worker() {
 	should_stop = false;
-	thread = std::thread([this]() {
-		while (!should_stop) {
-			while (!tasks.empty()) {
-				tasks.front()();
-				tasks.pop();
+	n_submitted = 0;
+	n_unfinished = 0;
+	pool_stop = false;
+	pending_chunk_jobs = 0;
+	next_queue = 0;
+
+	// the thread calling a parallel loop takes part in it, so one less,
+	// but submitted tasks always need at least one pool thread
+	const size_t hardware = std::max(2u, std::thread::hardware_concurrency());
+	const size_t n_pool = hardware - 1;
+	active_pool = n_pool;
+	serial_loops = false;
+	for (size_t i = 0; i < n_pool; ++i) {
+		chunk_queues.emplace_back(new ChunkQueue());
+	}
+	for (size_t i = 0; i < n_pool; ++i) {
+		pool.emplace_back([this, i]() { RunPool(i); });
+	}
+
+	thread = std::thread([this]() { Run(); });
+}
+
+void Worker::Run() {
+	Trace::SetThreadName("Worker");
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		// sleep until there is something to do, no polling
+		wakeup.wait(lock, [this]() { return should_stop || !tasks.empty(); });
+		if (tasks.empty()) return; // stopped and nothing left to run
+
+		TaskHandle task = tasks.top();
+		tasks.pop();
+		running = task;
+
+		// run the task without holding the lock so other threads can enqueue
+		lock.unlock();
+		RunTask(task);
+		lock.lock();
+		running = nullptr;
+	}
+}
+
+size_t Worker::Concurrency() {
+	return MaxConcurrency();
+}
+
+void Worker::SetMaxConcurrency(size_t n) {
+	Worker& worker = Instance();
+	if (n == 0) n = worker.pool.size() + 1;
+	n = std::min(n, worker.pool.size() + 1);
+	worker.active_pool = std::max<size_t>(1, n - 1);
+	worker.serial_loops = n == 1;
+	{
+		std::lock_guard<std::mutex> lock(worker.pool_mutex);
+	}
+	worker.pool_wakeup.notify_all();
+}
+
+size_t Worker::MaxConcurrency() {
+	const Worker& worker = Instance();
+	return worker.serial_loops ? 1 : worker.active_pool + 1;
+}
+
+size_t Worker::ChunkCount(size_t n) {
+	const size_t max_chunks = Concurrency() * chunks_per_thread;
+	const size_t chunks = (n + min_chunk_size - 1) / min_chunk_size;
+	return std::max<size_t>(1, std::min(chunks, max_chunks));
+}
+
+// chunks of a parallel loop, claimed in order by the calling thread and the 
+// pool threads helping it. Helpers can start after the loop returned, so they 
+// share ownership, but they only touch the body after claiming a chunk
+struct Worker::Loop {
+	Loop(size_t begin, size_t n, size_t n_chunks,
+		const std::function<void(size_t, size_t, size_t)>& body)
+		: begin(begin), n(n), n_chunks(n_chunks), body(body), task(current_task),
+		next(0), remaining(n_chunks) {}
+
+	size_t ChunkBegin(size_t chunk) const { return begin + n * chunk / n_chunks; }
+
+	// counts a chunk as done when it goes out of scope, also if the body threw
+	struct ChunkDone {
+		explicit ChunkDone(Loop& loop) : loop(loop) {}
+		~ChunkDone() {
+			if (--loop.remaining > 0) return;
+			std::lock_guard<std::mutex> lock(loop.mutex);
+			loop.done.notify_all();
+		}
+		Loop& loop;
+	};
+
+	void Run() {
+		// the chunks see the task that started the loop, wherever they run
+		Task* previous = current_task;
+		current_task = task;
+		for (size_t chunk = next++; chunk < n_chunks; chunk = next++) {
+			ChunkDone chunk_done(*this);
+			try {
+				body(chunk, ChunkBegin(chunk), ChunkBegin(chunk + 1));
+			} catch (...) {
+				// pool threads cannot throw, the caller rethrows it
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error) error = std::current_exception();
+			}
+		}
+		current_task = previous;
+	}
+
+	// blocks until the chunks claimed by other threads are done
+	void Wait() {
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]() { return remaining == 0; });
+	}
+
+	const size_t begin;
+	const size_t n;
+	const size_t n_chunks;
+	const std::function<void(size_t, size_t, size_t)>& body;
+	Task* const task;
+	std::atomic<size_t> next;
+	std::atomic<size_t> remaining;
+	std::mutex mutex;
+	std::condition_variable done;
+	std::exception_ptr error; // first exception thrown by a chunk, protected by mutex
+};
+
+void Worker::ParallelChunks(size_t begin, size_t end,
+	const std::function<void(size_t, size_t, size_t)>& body) {
+	if (end <= begin) return;
+	RunLoop(begin, end - begin, ChunkCount(end - begin), body);
+}
+
+void Worker::ParallelChunks(size_t begin, size_t end, size_t n_chunks,
+	const std::function<void(size_t, size_t, size_t)>& body) {
+	if (end <= begin) return;
+	RunLoop(begin, end - begin, n_chunks, body);
+}
+
+void Worker::ParallelPieces(size_t n, const std::function<void(size_t)>& body) {
+	RunLoop(0, n, n, [&body](size_t piece, size_t, size_t) { body(piece); });
+}
+
+void Worker::RunLoop(size_t begin, size_t n, size_t n_chunks,
+	const std::function<void(size_t, size_t, size_t)>& body) {
+	if (n_chunks == 0) return;
+	Worker& worker = Instance();
+	if (n_chunks == 1 || worker.serial_loops) {
+		for (size_t chunk = 0; chunk < n_chunks; ++chunk) {
+			body(chunk, begin + n * chunk / n_chunks, begin + n * (chunk + 1) / n_chunks);
+		}
+		return;
+	}
+
+	TRACE_SCOPE("Parallel loop");
+	std::shared_ptr<Loop> loop = std::make_shared<Loop>(begin, n, n_chunks, body);
+	const size_t helpers = std::min<size_t>(n_chunks - 1, worker.active_pool);
+	for (size_t i = 0; i < helpers; ++i) {
+		worker.PushChunkJob([loop]() { loop->Run(); });
+	}
+
+	loop->Run();
+
+	// only chunks of this loop, so waiting is never longer than the loop itself
+	loop->Wait();
+	if (loop->error) std::rethrow_exception(loop->error);
+}
+
+void Worker::PushChunkJob(std::function<void()> job) {
+	// pool threads push to their own queue, everyone else spreads the jobs
+	const size_t index = pool_index >= 0 ? pool_index : next_queue++ % active_pool;
+	{
+		std::lock_guard<std::mutex> lock(chunk_queues[index]->mutex);
+		chunk_queues[index]->jobs.push_back(std::move(job));
+	}
+	++pending_chunk_jobs;
+	WakePool();
+}
+
+void Worker::WakePool() {
+	{
+		// lock so a pool thread cannot miss the wakeup between check and wait
+		std::lock_guard<std::mutex> lock(pool_mutex);
+	}
+	// inactive threads ignore the wakeup, so it must reach an active one
+	if (active_pool < pool.size()) {
+		pool_wakeup.notify_all();
+	} else {
+		pool_wakeup.notify_one();
+	}
+}
+
+bool Worker::TryRunChunkJob() {
+	if (pending_chunk_jobs == 0) return false;
+	const size_t n = chunk_queues.size();
+	const size_t self = pool_index >= 0 ? pool_index : 0;
+	for (size_t k = 0; k < n; ++k) {
+		const size_t index = (self + k) % n;
+		const bool own = pool_index >= 0 && k == 0;
+		std::function<void()> job;
+		{
+			std::lock_guard<std::mutex> lock(chunk_queues[index]->mutex);
+			std::deque<std::function<void()>>& jobs = chunk_queues[index]->jobs;
+			if (jobs.empty()) continue;
+			// own queue is LIFO for locality, steal the oldest from the others
+			if (own) {
+				job = std::move(jobs.back());
+				jobs.pop_back();
+			} else {
+				job = std::move(jobs.front());
+				jobs.pop_front();
 			}
-			std::this_thread::sleep_for(std::chrono::milliseconds(100));
 		}
-	});
+		--pending_chunk_jobs;
+		job();
+		return true;
+	}
+	return false;
+}
+
+bool Worker::TryRunTask() {
+	TaskHandle task;
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		while (!pool_tasks.empty() && !task) {
+			task = pool_tasks.top();
+			pool_tasks.pop();
+			// a thread waiting for it may have run it already
+			if (task->claimed_.exchange(true)) task = nullptr;
+		}
+	}
+	if (!task) return false;
+	RunTask(task);
+	return true;
+}
+
+void Worker::RunPool(size_t index) {
+	pool_index = (int)index;
+	Trace::SetThreadName("Pool " + std::to_string(index));
+	while (true) {
+		const bool active = index < active_pool;
+		// loops block their caller, so they go before tasks
+		if (active && (TryRunChunkJob() || TryRunTask())) continue;
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		pool_wakeup.wait(lock, [this, index]() { 
+			return pool_stop || ((pending_chunk_jobs > 0 || !pool_tasks.empty()) && index < active_pool); });
+		if (pool_stop) return;
+	}
 }
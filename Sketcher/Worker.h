@@ -3,15 +3,240 @@
 #include <thread>
 #include <functional>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <type_traits>
+
+// Tasks with higher priority are run first, equal priorities run in order
+enum class Priority {
+	Low,
+	Normal,
+	High,
+};
+
+// State of a task enqueued with Worker::Do, shared between the worker and the caller
+class Task {
+public:
+	enum State {
+		Queued,
+		Running,
+		Done,
+		Cancelled,
+	};
+
+	const std::string& Name() const { return name_; }
+	Priority GetPriority() const { return priority_; }
+	State GetState() const { return state_; }
+	bool Finished() const { return state_ == Done || state_ == Cancelled; }
+
+	// Fraction of the task completed, in range [0, 1]
+	float Progress() const { return progress_; }
+
+	// A queued task is dropped. A running task stops the next time it checks
+	// Worker::Cancelled(), tasks that never check it run to the end. The task
+	// ends Cancelled if it was dropped or Worker::Cancelled() returned true in
+	// it, otherwise it ran to the end and is Done.
+	void Cancel() { cancel_ = true; }
+	bool CancelRequested() const { return cancel_; }
+
+private:
+	friend class Worker;
+
+	Task(std::function<void()> run, Priority priority, const std::string& name,
+		const char* trace_name, size_t sequence)
+		: run_(std::move(run)), priority_(priority), name_(name), trace_name_(trace_name), sequence_(sequence),
+		state_(Queued), progress_(0.0f), cancel_(false), cancel_seen_(false), unmet_dependencies_(0),
+		ready_(false), claimed_(false) {}
+
+	std::function<void()> run_;
+	const Priority priority_;
+	const std::string name_;
+	const char* const trace_name_; // interned when the task is created
+	const size_t sequence_;
+	std::atomic<State> state_;
+	std::atomic<float> progress_;
+	std::atomic<bool> cancel_;
+	// set when Worker::Cancelled() returned true in the task, so it may have stopped early
+	std::atomic<bool> cancel_seen_;
+
+	// tasks waiting for this one, protected by the worker graph mutex
+	std::vector<std::shared_ptr<Task>> dependents_;
+	std::atomic<int> unmet_dependencies_;
+
+	// submitted task whose dependencies are done, waiting for a pool thread
+	std::atomic<bool> ready_;
+	// set by the thread that runs a submitted task, the pool or a waiting thread
+	std::atomic<bool> claimed_;
+};
+
+using TaskHandle = std::shared_ptr<Task>;
+
+// Returned by Worker::Submit: the future of the result, plus the task handle
+// so it can be cancelled or used as a dependency of other tasks.
+// get() throws std::future_error if the task was dropped before it started.
+// A task that stopped early after seeing Worker::Cancelled() is Cancelled,
+// and get() returns whatever it returned.
+template <typename T>
+class TaskFuture : public std::shared_future<T> {
+public:
+	TaskFuture() {}
+	TaskFuture(std::shared_future<T> future, TaskHandle handle)
+		: std::shared_future<T>(std::move(future)), handle_(std::move(handle)) {}
+
+	const TaskHandle& Handle() const { return handle_; }
+	operator TaskHandle() const { return handle_; }
+
+	// Waits for the task, see Worker::Wait
+	void Wait() const;
+
+private:
+	TaskHandle handle_;
+};
 
 class Worker {
 public:
-	// Enqueue the task. Returns false if the task is not accepted.
-	static bool Do(std::function<void()> task);
+	// Enqueue the task. Returns nullptr if the task is not accepted.
+	// Safe to call from any thread. Tasks run one at a time, by priority then in order.
+	static TaskHandle Do(std::function<void()> task, 
+		Priority priority = Priority::Normal, const std::string& name = "");
+
+	// Run f() on the thread pool once all the tasks in after are done and
+	// return its future. Tasks without dependencies between them run at the same
+	// time, ready tasks start by priority then in order. If a dependency is 
+	// cancelled, the task is cancelled too. Parallel loops run before tasks.
+	// Do not block on a future inside a submitted task, make it a dependency.
+	template <typename F>
+	static TaskFuture<typename std::result_of<F()>::type> Submit(F f,
+		const std::vector<TaskHandle>& after = {}, const std::string& name = "",
+		Priority priority = Priority::Normal) {
+		using Result = typename std::result_of<F()>::type;
+		auto job = std::make_shared<std::packaged_task<Result()>>(std::move(f));
+		std::shared_future<Result> future = job->get_future().share();
+		TaskHandle handle = SubmitTask([job]() { (*job)(); }, after, name, priority);
+		return TaskFuture<Result>(std::move(future), std::move(handle));
+	}
+
+	// Blocks until the task is finished. If the submitted task is ready but no
+	// pool thread took it yet, the waiting thread runs it. It never runs other
+	// tasks or loop chunks, so waiting does not last longer than the task.
+	static void Wait(const TaskHandle& task);
 
 	// Stop the worker once the current tasks are completed. Warning: blocking.
 	static void Stop();
 
+	// The task currently running, nullptr if idle
+	static TaskHandle Running();
+	// Number of tasks waiting to run
+	static size_t QueueSize();
+	// True if no task is queued, waiting for its dependencies or running,
+	// submitted tasks included
+	static bool Idle();
+
+	// Prints the enqueue to start latency and the tasks per second of Do and
+	// Submit. Call it from the main thread while no task is running
+	static void Benchmark();
+
+	// Called on the thread that ran the task after every task finishes, done or cancelled.
+	// Parallel loop chunks do not count as tasks
+	static void SetTaskDoneCallback(std::function<void()> callback);
+
+	// ==== From inside a task ====
+	// True if the running task was asked to stop. Long tasks should check it
+	// every now and then and return early. Always false outside of tasks.
+	// Parallel loops started by a task see it on every thread taking part
+	static bool Cancelled();
+	// Report the progress of the running task, in range [0, 1]
+	static void SetProgress(float progress);
+
+	// ==== Parallel loops ====
+	// Parallel loops are split in chunks and run on a work-stealing thread pool
+	// sized to the machine. They are blocking: the calling thread works on the
+	// chunks too, so they can be called from anywhere, including from a task
+	// or from inside another parallel loop. Once no chunk is left to claim it
+	// sleeps until the other threads finish theirs. If a body throws, the other
+	// chunks still run and the loop rethrows the first exception.
+
+	// Number of threads taking part in a parallel loop (pool + calling thread)
+	static size_t Concurrency();
+	// Limits the threads used by parallel loops, for benchmarking. 0 uses all of them.
+	// With 1 loops run serially, submitted tasks still get one pool thread.
+	// It applies to every thread, so only change it while Idle().
+	static void SetMaxConcurrency(size_t n);
+	static size_t MaxConcurrency();
+
+	// Number of chunks a range of n elements is split into. It changes with
+	// SetMaxConcurrency, so take it once and pass it to ParallelChunks when
+	// something is sized by it
+	static size_t ChunkCount(size_t n);
+
+	// Calls body(chunk, chunk_begin, chunk_end) for every chunk of [begin, end),
+	// in [0, ChunkCount(end - begin))
+	static void ParallelChunks(size_t begin, size_t end,
+		const std::function<void(size_t chunk, size_t chunk_begin, size_t chunk_end)>& body);
+	// Same with n_chunks chunks, which are always the same for the same range and count
+	static void ParallelChunks(size_t begin, size_t end, size_t n_chunks,
+		const std::function<void(size_t chunk, size_t chunk_begin, size_t chunk_end)>& body);
+
+	// Calls body(piece) for every piece in [0, n), each one as its own chunk.
+	// For a few large pieces of work, like the halves of a recursive split
+	static void ParallelPieces(size_t n, const std::function<void(size_t piece)>& body);
+
+	// Calls body(i) for every i in [begin, end)
+	template <typename Body>
+	static void ParallelFor(size_t begin, size_t end, const Body& body) {
+		ParallelChunks(begin, end, [&body](size_t, size_t b, size_t e) {
+			for (size_t i = b; i < e; ++i) body(i);
+		});
+	}
+
+	// Combines map(i) for every i in [begin, end) using reduce.
+	// Partial results are combined in index order, so the result is deterministic
+	template <typename T, typename Map, typename Reduce>
+	static T ParallelReduce(size_t begin, size_t end, const T& identity,
+		const Map& map, const Reduce& reduce) {
+		if (end <= begin) return identity;
+		std::vector<T> partial(ChunkCount(end - begin), identity);
+		ParallelChunks(begin, end, partial.size(), [&](size_t chunk, size_t b, size_t e) {
+			T value = identity;
+			for (size_t i = b; i < e; ++i) value = reduce(value, map(i));
+			partial[chunk] = value;
+		});
+		T result = identity;
+		for (const T& value : partial) result = reduce(result, value);
+		return result;
+	}
+
+	// Writes the running sum of count(i) for i in [0, n) to offsets, so
+	// offsets[i] is the sum of all counts before i and offsets[n] is the total
+	template <typename T, typename Count>
+	static void ParallelPrefixSum(size_t n, std::vector<T>& offsets, const Count& count) {
+		offsets.resize(n + 1);
+		// sum every chunk, then offset the chunks by the sum of the previous ones
+		const size_t n_chunks = ChunkCount(n);
+		std::vector<T> chunk_offset(n_chunks + 1, T(0));
+		ParallelChunks(0, n, n_chunks, [&](size_t chunk, size_t b, size_t e) {
+			T sum = T(0);
+			for (size_t i = b; i < e; ++i) {
+				offsets[i] = sum;
+				sum += count(i);
+			}
+			chunk_offset[chunk + 1] = sum;
+		});
+		for (size_t chunk = 1; chunk < chunk_offset.size(); ++chunk) {
+			chunk_offset[chunk] += chunk_offset[chunk - 1];
+		}
+		ParallelChunks(0, n, n_chunks, [&](size_t chunk, size_t b, size_t e) {
+			for (size_t i = b; i < e; ++i) offsets[i] += chunk_offset[chunk];
+		});
+		offsets[n] = chunk_offset.back();
+	}
+
 private:
 	static Worker& Instance() {
 		static Worker worker;
@@ -20,7 +245,68 @@ private:
 
 	Worker();
 
+	void Run();
+
+	static TaskHandle SubmitTask(std::function<void()> run,
+		const std::vector<TaskHandle>& after, const std::string& name, Priority priority);
+	// runs the task on the calling thread and schedules its dependents
+	void RunTask(const TaskHandle& task);
+	void Schedule(const TaskHandle& task);
+
+	struct TaskOrder {
+		bool operator()(const TaskHandle& a, const TaskHandle& b) const {
+			if (a->priority_ != b->priority_) return a->priority_ < b->priority_;
+			return a->sequence_ > b->sequence_;
+		}
+	};
+
+	// ---- thread pool ----
+	// jobs helping with the chunks of a parallel loop
+	struct ChunkQueue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> jobs;
+	};
+	struct Loop;
+
+	// splits [begin, begin + n) in n_chunks and runs them on the pool and this thread
+	static void RunLoop(size_t begin, size_t n, size_t n_chunks,
+		const std::function<void(size_t, size_t, size_t)>& body);
+	void RunPool(size_t index);
+	void PushChunkJob(std::function<void()> job);
+	// runs one pending chunk job, own queue first then stealing from the others
+	bool TryRunChunkJob();
+	// runs the most urgent ready submitted task
+	bool TryRunTask();
+	void WakePool();
+
 	bool should_stop;
 	std::thread thread;
-	std::queue<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::priority_queue<TaskHandle, std::vector<TaskHandle>, TaskOrder> tasks;
+	size_t n_submitted;
+	std::atomic<size_t> n_unfinished; // tasks of Do and Submit not finished yet
+	TaskHandle running;
+
+	std::vector<std::thread> pool;
+	std::vector<std::unique_ptr<ChunkQueue>> chunk_queues;
+	std::atomic<size_t> pending_chunk_jobs;
+	// submitted tasks ready to run, protected by pool_mutex
+	std::priority_queue<TaskHandle, std::vector<TaskHandle>, TaskOrder> pool_tasks;
+	std::atomic<size_t> active_pool; // pool threads allowed to run jobs
+	std::atomic<bool> serial_loops;
+	std::atomic<size_t> next_queue;
+	std::mutex pool_mutex;
+	std::condition_variable pool_wakeup;
+	bool pool_stop;
+
+	// dependencies between tasks
+	std::mutex graph_mutex;
+	std::condition_variable task_done;
+	std::function<void()> task_done_callback; // protected by graph_mutex
 };
+
+template <typename T>
+void TaskFuture<T>::Wait() const {
+	Worker::Wait(handle_);
+}
@@ -4,6 +4,9 @@ initialization of the window, handling of main loop, and IO callbacks
 */
 
 #include <stdio.h>
+#include <thread>
+#include <chrono>
+#include <algorithm>
 
 #include <GL\gl3w.h>
 #include <GLFW\glfw3.h>
@@ -15,6 +18,8 @@ initialization of the window, handling of main loop, and IO callbacks
 #include "Renderer.h"
 #include "Application.h"
 #include "Log.h"
+#include "Trace.h"
+#include "MeshCache.h"
 
 Application* app = nullptr;
 
@@ -25,6 +30,15 @@ static void cursorPos_callback(GLFWwindow* win, double x, double y);
 static void scroll_callback(GLFWwindow* win, double x_offset, double y_offset);
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode);
 static void char_callback(GLFWwindow* window, unsigned int c);
+static void refresh_callback(GLFWwindow* window);
+static void focus_callback(GLFWwindow* window, int focused);
+
+// ImGui reacts to input one frame late, so a few frames are drawn after each change
+static const int frames_after_change = 3;
+// time between frames while a task runs, to show its progress
+static const double task_refresh_interval = 0.1;
+// longest wait for events when nothing changes
+static const double idle_timeout = 1.0;
 
 int CALLBACK WinMain(
 	_In_ HINSTANCE hInstance,
@@ -33,6 +47,7 @@ int CALLBACK WinMain(
 	_In_ int       nCmdShow
 ) {
 //int WinMain(int argc, char **argv) {
+	Trace::SetThreadName("Main");
 
 	glfwSetErrorCallback(error_callback);
 	if (!glfwInit())
@@ -58,6 +73,8 @@ int CALLBACK WinMain(
 	char buf[256];
 	sprintf_s(buf, "%s\\sketcher.ini", appdata);
 	ImGui::GetIO().IniFilename = buf;
+	Log::file_path = std::string(appdata) + "\\sketcher.log";
+	MeshCache::directory = std::string(appdata) + "\\sketcher_cache";
 
 	glfwSetMouseButtonCallback(window, mouseButton_callback);
 	glfwSetCursorPosCallback(window, cursorPos_callback);
@@ -65,27 +82,84 @@ int CALLBACK WinMain(
 	glfwSetKeyCallback(window, key_callback);
 	glfwSetCharCallback(window, char_callback);
 	glfwSetFramebufferSizeCallback(window, size_callback);
+	glfwSetWindowRefreshCallback(window, refresh_callback);
+	glfwSetWindowFocusCallback(window, focus_callback);
 
 	Worker::Do([]() {}); // start up the worker
 	Renderer::Instance(); // initialize the renderer
-
+	// finished tasks may have changed what is drawn
+	Worker::SetTaskDoneCallback([]() { Renderer::Instance().RequestRedraw(); });
+
+	int frames_left = frames_after_change;
+	double last_frame = 0.0;
+	// main loop statistics, see Application::loop_fps
+	double stats_start = glfwGetTime();
+	double waited = 0.0;
+	int frames = 0;
 	while (!glfwWindowShouldClose(window)) {
-		glfwPollEvents();
+		const double now = glfwGetTime();
+		if (now - stats_start >= 1.0) {
+			app->loop_fps = (float)(frames / (now - stats_start));
+			app->loop_busy = (float)std::max(0.0, 1.0 - waited / (now - stats_start));
+			stats_start = now;
+			waited = 0.0;
+			frames = 0;
+		}
+
+		if (Renderer::Instance().NeedsRedraw()) frames_left = frames_after_change;
+		if (app->redraw_on_demand && frames_left == 0) {
+			const bool task_running = Worker::Running() != nullptr;
+			const double wait_start = glfwGetTime();
+			{
+				TRACE_SCOPE("Wait events");
+				glfwWaitEventsTimeout(task_running ? task_refresh_interval : idle_timeout);
+			}
+			waited += glfwGetTime() - wait_start;
+			if (Renderer::Instance().NeedsRedraw()) {
+				frames_left = frames_after_change;
+			} else if (task_running) {
+				frames_left = 1;
+			} else {
+				continue; // timed out with nothing to draw
+			}
+		} else {
+			glfwPollEvents();
+		}
+
+		if (app->max_fps > 0) {
+			const double remaining = last_frame + 1.0 / app->max_fps - glfwGetTime();
+			if (remaining > 0.0) {
+				std::this_thread::sleep_for(std::chrono::duration<double>(remaining));
+				waited += remaining;
+			}
+		}
+		last_frame = glfwGetTime();
+		TRACE_SCOPE("Frame");
+
 		ImGui_ImplGlfwGL3_NewFrame();
 
-		app->DrawInterface(window);
+		{
+			TRACE_SCOPE("Interface");
+			app->DrawInterface(window);
+		}
 		
 		Renderer::Instance().Render();
 
-		ImGui::Render();
-		glfwSwapBuffers(window);
+		{
+			TRACE_SCOPE("Swap buffers");
+			ImGui::Render();
+			glfwSwapBuffers(window);
+		}
 
 		app->PostRender();
+		if (frames_left > 0) --frames_left;
+		++frames;
 	}
 
 	// Cleanup
 	Renderer::Instance().Terminate();
 	Worker::Stop();
+	Log::Instance().CloseFile();
 	
 	ImGui_ImplGlfwGL3_Shutdown();
 	glfwTerminate();
@@ -94,31 +168,44 @@ int CALLBACK WinMain(
 }
 
 static void error_callback(int error, const char* description) {
-	print("Error %d: %s\n", error, description);
+	print(LogLevel::Error, "GLFW error %d: %s\n", error, description);
 }
 
 static void size_callback(GLFWwindow* win, int w, int h) {
 	Renderer::Instance().Resize(w, h);
+	Renderer::Instance().RequestRedraw();
+}
+
+static void refresh_callback(GLFWwindow* window) {
+	Renderer::Instance().RequestRedraw();
+}
+
+static void focus_callback(GLFWwindow* window, int focused) {
+	Renderer::Instance().RequestRedraw();
 }
 
 static void mouseButton_callback(GLFWwindow* win, int button, int action, int mod) {
+	Renderer::Instance().RequestRedraw();
 	ImGui_ImplGlfwGL3_MouseButtonCallback(win, button, action, mod);
 	if (ImGui::GetIO().WantCaptureMouse) return;
 	Renderer::Instance().mouseButton_callback(win, button, action, mod);
 }
 
 static void cursorPos_callback(GLFWwindow* win, double x, double y) {
+	Renderer::Instance().RequestRedraw();
 	if (ImGui::GetIO().WantCaptureMouse) return;
 	Renderer::Instance().cursorpos_callback(win, x, y);
 }
 
 static void scroll_callback(GLFWwindow* win, double x_offset, double y_offset) {
+	Renderer::Instance().RequestRedraw();
 	ImGui_ImplGlfwGL3_ScrollCallback(win, x_offset, y_offset);
 	if (ImGui::GetIO().WantCaptureMouse) return;
 	Renderer::Instance().scroll_callback(win, x_offset, y_offset);
 }
 
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode) {
+	Renderer::Instance().RequestRedraw();
 	ImGui_ImplGlfwGL3_KeyCallback(window, key, scancode, action, mode);
 	if (ImGui::GetIO().WantTextInput) return;
 
@@ -142,6 +229,7 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 }
 
 static void char_callback(GLFWwindow* window, unsigned int c) {
+	Renderer::Instance().RequestRedraw();
 	ImGui_ImplGlfwGL3_CharCallback(window, c);
 	if (ImGui::GetIO().WantTextInput) return;
 }
@@ -0,0 +1,31 @@
+// Shared by all the shaders, GLShader inserts it after the #version line
+
+// per-frame state, updated once per frame. Must match Renderer::FrameData
+layout(std140) uniform FrameData {
+	mat4 modelViewProjMatrix;
+	mat4 modelViewMatrix;
+	mat3 normalMatrix;
+	mat3 viewMatrix;
+	vec4 lights[3]; // xyz position, w intensity
+};
+
+// vertex format, see Renderer::SetVertexFormat. Positions may be normalized 
+// integers in the bounding box, and normals octahedral coordinates in [0, 1]
+uniform vec3 position_offset = vec3(0.0);
+uniform vec3 position_scale = vec3(1.0);
+uniform bool octahedral_normals = false;
+
+vec3 DecodePosition(vec3 p) {
+	return position_offset + position_scale * p;
+}
+
+vec3 DecodeNormal(vec3 n) {
+	if (!octahedral_normals) return n;
+	vec2 e = n.xy * 2.0 - 1.0;
+	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (v.z < 0.0) {
+		vec2 s = vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+		v.xy = (1.0 - abs(e.yx)) * s;
+	}
+	return normalize(v);
+}
@@ -1,6 +1,5 @@
 #version 330
 
-uniform mat4 modelViewProjMatrix;
 uniform vec4 vert_color;
 
 in vec3 position;
@@ -0,0 +1,8 @@
+#version 330
+
+// triangle index + 1, so 0 means background
+layout(location = 0) out uint id;
+
+void main() {
+	id = uint(gl_PrimitiveID + 1);
+}
@@ -0,0 +1,7 @@
+#version 330
+
+in vec3 position;
+
+void main() {
+	gl_Position = modelViewProjMatrix * vec4(DecodePosition(position), 1.0);
+}
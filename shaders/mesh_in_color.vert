@@ -1,7 +1,5 @@
 #version 330
 
-uniform mat4 modelViewProjMatrix;
-
 in vec3 position;
 in vec3 normal;
 
@@ -1,7 +1,5 @@
 #version 330
 
-uniform mat3 viewMatrix = mat3(1.0);
-
 uniform float ambient_intensity = 0.3;
 uniform float diffuse_intensity = 1.0;
 uniform float specular_intensity = 1.0;
@@ -10,15 +8,6 @@ uniform float shininess = 15.0;
 // using the same color for all lights
 const vec3 LightColor = vec3(1, 1, 1);
 
-uniform vec3 l0Position = vec3(6, 3, 3); // key light
-uniform float l0Intensity = 1.0;
-
-uniform vec3 l1Position = vec3(6, 0, -3); // back light
-uniform float l1Intensity = 0.5;
-
-uniform vec3 l2Position = vec3(-6, 0, 2); // fill light
-uniform float l2Intensity = 0.7;
-
 // const vec3 MaterialDiffuseColor = vec3(0.34, 0.61, 0.74);
 uniform vec3 DiffuseMaterial = vec3(0.6, 0.5, 0.4);
 uniform vec3 AmbientMaterial = vec3(0.2, 0.2, 0.2);
@@ -33,6 +22,14 @@ in vec3 V;
 out vec4 color;
 
 void main() {
+	// key, back and fill light
+	vec3 l0Position = lights[0].xyz;
+	vec3 l1Position = lights[1].xyz;
+	vec3 l2Position = lights[2].xyz;
+	float l0Intensity = lights[0].w;
+	float l1Intensity = lights[1].w;
+	float l2Intensity = lights[2].w;
+
 	// normalize the normal
 	vec3 norm = normalize(N);
 
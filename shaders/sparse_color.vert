@@ -0,0 +1,17 @@
+#version 330
+
+// colors of the even and odd vertices, e.g. both ends of a line
+uniform vec4 color_even;
+uniform vec4 color_odd;
+
+in vec3 position;
+in vec3 normal;
+
+out vec4 vs_color;
+out vec3 vs_normal;
+
+void main() {
+	vs_color = (gl_VertexID % 2 == 0) ? color_even : color_odd;
+	vs_normal = DecodeNormal(normal);
+	gl_Position = vec4(DecodePosition(position), 1.0);
+}